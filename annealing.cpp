@@ -0,0 +1,104 @@
+#include "annealing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+//palette movement, in multiples of the palette tolerance, at which
+//AdaptiveSchedule is about two thirds of the way to its slow factor
+static const float kAdaptiveMovementScale = 4.0f;
+
+AnnealingSchedule::AnnealingSchedule()
+  : final_temperature_(kTF), palette_tolerance_(kPaletteErrorTolerance),
+    subcluster_tolerance_(kSubclusterTolerance) {
+}
+bool AnnealingSchedule::AtEquilibrium(const AnnealingState& state) {
+  return state.palette_error < palette_tolerance_;
+}
+
+GeometricSchedule::GeometricSchedule(float factor) : factor_(factor) {
+}
+float GeometricSchedule::Cool(const AnnealingState& state) {
+  return state.temperature*factor_;
+}
+
+AdaptiveSchedule::AdaptiveSchedule(float fast_factor, float slow_factor)
+  : fast_factor_(fast_factor), slow_factor_(slow_factor), movement_(0) {
+}
+void AdaptiveSchedule::Start(float temperature) {
+  movement_ = 0;
+}
+bool AdaptiveSchedule::AtEquilibrium(const AnnealingState& state) {
+  movement_ += state.palette_error;
+  return AnnealingSchedule::AtEquilibrium(state);
+}
+float AdaptiveSchedule::Cool(const AnnealingState& state) {
+  float settled = exp(-movement_/(kAdaptiveMovementScale*palette_tolerance()));
+  movement_ = 0;
+  return state.temperature*(slow_factor_ - (slow_factor_-fast_factor_)*settled);
+}
+
+CriticalSchedule::CriticalSchedule(float margin, float factor)
+  : margin_(margin), factor_(factor) {
+}
+float CriticalSchedule::Cool(const AnnealingState& state) {
+  //jump to the highest target ahead, however far below the geometric 
+  //step it is. A jump has to cool by at least the margin: a color the run
+  //already stopped just above is no target any more, so the following 
+  //step crosses its critical temperature instead of creeping up to it.
+  float next = -1;
+  for(size_t i = 0; i<state.critical_temperatures.size(); ++i) {
+    float target = state.critical_temperatures[i]*margin_;
+    if(target*margin_ < state.temperature && target > next && 
+      state.critical_temperatures[i] > final_temperature())
+        next = target;
+  }
+  if(next < 0)
+    return state.temperature*factor_;
+  return next;
+}
+
+BudgetSchedule::BudgetSchedule(int iterations)
+  : iterations_(std::max(1, iterations)), start_temperature_(kTF),
+    start_iteration_(0), started_(false) {
+}
+void BudgetSchedule::Start(float temperature) {
+  start_temperature_ = temperature;
+  started_ = false;
+}
+bool BudgetSchedule::AtEquilibrium(const AnnealingState& state) {
+  //the path is counted from the first iteration after Start()
+  if(!started_) {
+    start_iteration_ = state.iteration - 1;
+    started_ = true;
+  }
+  if(state.temperature > final_temperature())
+    return true;
+  return AnnealingSchedule::AtEquilibrium(state);
+}
+float BudgetSchedule::Cool(const AnnealingState& state) {
+  if(start_temperature_ <= final_temperature())
+    return final_temperature();
+  float progress = std::min(1.0f,
+    (state.iteration - start_iteration_)/(float)iterations_);
+  return start_temperature_*
+    pow(final_temperature()/start_temperature_, progress);
+}
+
+AnnealingSchedulePtr ParseAnnealingSchedule(const std::string& spec) {
+  if(spec == "geometric")
+    return AnnealingSchedulePtr(new GeometricSchedule());
+  if(spec == "adaptive")
+    return AnnealingSchedulePtr(new AdaptiveSchedule());
+  if(spec == "critical")
+    return AnnealingSchedulePtr(new CriticalSchedule());
+  const std::string budget = "budget:";
+  if(spec.compare(0, budget.size(), budget) == 0) {
+    const char * begin = spec.c_str() + budget.size();
+    char * end;
+    long iterations = strtol(begin, &end, 10);
+    if(end != begin && *end == '\0' && iterations > 0)
+      return AnnealingSchedulePtr(new BudgetSchedule((int)iterations));
+  }
+  return AnnealingSchedulePtr();
+}
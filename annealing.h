@@ -0,0 +1,145 @@
+/*
+Description: Annealing schedules decide how Pix lowers its temperature. After
+every iteration the schedule is asked whether the palette has reached
+equilibrium at the current temperature; if so, Pix expands the palette and
+either lowers the temperature to the one the schedule picks or, at the final
+temperature, stops. Schedules trade the quality of the result against the
+number of iterations.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+//default cooling factor of the geometric schedule
+const float kDT = .7f;
+//default final temperature, the run converges at equilibrium there
+const float kTF = 1.0f;
+//palette error below which the palette is at equilibrium
+const float kPaletteErrorTolerance = 1.0f;
+//distance between subclusters above which a color is split
+const float kSubclusterTolerance = 1.6f;
+//how far above a predicted critical temperature CriticalSchedule stops,
+//like the safety factor of the starting temperature
+const float kCriticalMargin = 1.1f;
+
+//What a schedule gets to see of a completed iteration
+struct AnnealingState {
+  //number of completed iterations, including this one
+  int iteration;
+  //the temperature the iteration ran at
+  float temperature;
+  //the total change of the palette colors in the iteration's refinement
+  float palette_error;
+  //the critical temperature of every color that can still split: the
+  //temperature below which it is expected to split, sqrt(2) times the
+  //square root of the largest eigenvalue of its color covariance. Only
+  //filled when calling Cool() on a schedule that uses it, and empty once
+  //the palette is maxed out.
+  std::vector<float> critical_temperatures;
+};
+
+//Base of all schedules. A schedule may keep state about the run, so every
+//Pix instance needs its own.
+class AnnealingSchedule {
+ public:
+  AnnealingSchedule();
+  virtual ~AnnealingSchedule() {}
+
+  //Called when a run starts, or continues with this schedule, at the
+  //given temperature
+  virtual void Start(float temperature) {}
+
+  //Returns whether the palette is at equilibrium after the iteration. The
+  //default compares the palette error against palette_tolerance().
+  virtual bool AtEquilibrium(const AnnealingState& state);
+
+  //Returns the temperature to continue at after an equilibrium above the
+  //final temperature. Values below final_temperature() are raised to it.
+  virtual float Cool(const AnnealingState& state) = 0;
+
+  //Returns whether Cool() uses AnnealingState::critical_temperatures,
+  //which costs a pass over the output per color
+  virtual bool uses_critical_temperatures() const {return false;}
+
+  inline float final_temperature() const {return final_temperature_;}
+  inline float palette_tolerance() const {return palette_tolerance_;}
+  inline float subcluster_tolerance() const {return subcluster_tolerance_;}
+  inline void set_final_temperature(float t) {final_temperature_ = t;}
+  inline void set_palette_tolerance(float t) {palette_tolerance_ = t;}
+  inline void set_subcluster_tolerance(float t) {subcluster_tolerance_ = t;}
+
+ private:
+  float final_temperature_, palette_tolerance_, subcluster_tolerance_;
+};
+
+typedef std::shared_ptr<AnnealingSchedule> AnnealingSchedulePtr;
+
+//Multiplies the temperature by a constant factor at every equilibrium. The
+//default schedule of Pix.
+class GeometricSchedule : public AnnealingSchedule {
+ public:
+  explicit GeometricSchedule(float factor = kDT);
+  virtual float Cool(const AnnealingState& state);
+
+ private:
+  float factor_;
+};
+
+//Cools by a factor between fast_factor and slow_factor depending on how
+//much the palette moved at the current temperature: a palette that
+//settled at once cools quickly, one that kept moving (close to a split)
+//slowly. The movement is measured in multiples of palette_tolerance().
+class AdaptiveSchedule : public AnnealingSchedule {
+ public:
+  AdaptiveSchedule(float fast_factor = .5f, float slow_factor = .9f);
+  virtual void Start(float temperature);
+  virtual bool AtEquilibrium(const AnnealingState& state);
+  virtual float Cool(const AnnealingState& state);
+
+ private:
+  float fast_factor_, slow_factor_;
+  //palette error summed over the iterations at the current temperature
+  float movement_;
+};
+
+//Skips the plateaus between splits: cools straight to margin times the
+//highest critical temperature that is still ahead, however far below the
+//current temperature, so the next split happens right after it. Falls 
+//back to cooling by factor when no color can split any more and when no
+//prediction is at least a margin below the current temperature.
+class CriticalSchedule : public AnnealingSchedule {
+ public:
+  CriticalSchedule(float margin = kCriticalMargin, float factor = kDT);
+  virtual float Cool(const AnnealingState& state);
+  virtual bool uses_critical_temperatures() const {return true;}
+
+ private:
+  float margin_, factor_;
+};
+
+//Cools geometrically from the starting temperature to the final one in a
+//fixed number of iterations, lowering the temperature after every
+//iteration whether or not the palette has settled. Only at the final
+//temperature does the run wait for an equilibrium. Gives a predictable
+//iteration count at the cost of quality on images with many colors.
+class BudgetSchedule : public AnnealingSchedule {
+ public:
+  explicit BudgetSchedule(int iterations);
+  virtual void Start(float temperature);
+  virtual bool AtEquilibrium(const AnnealingState& state);
+  virtual float Cool(const AnnealingState& state);
+
+ private:
+  int iterations_;
+  //temperature and iteration count at Start()
+  float start_temperature_;
+  int start_iteration_;
+  bool started_;
+};
+
+//Creates a schedule from its name: "geometric", "adaptive", "critical" or
+//"budget:<iterations>". Returns NULL if spec is not one of these.
+AnnealingSchedulePtr ParseAnnealingSchedule(const std::string& spec);
@@ -59,14 +59,61 @@ cv::Mat createNumpyNdArrayFromOutputImage(Pix& pa)
     return output;
 }
 
+//Selects the annealing schedule of a Pix object by name (see
+//ParseAnnealingSchedule), raising ValueError for unknown names
+void setScheduleByName(Pix& pa, const std::string& spec)
+{
+    AnnealingSchedulePtr schedule = ParseAnnealingSchedule(spec);
+    if (!schedule) {
+        PyErr_SetString(PyExc_ValueError, ("Unknown annealing schedule: " + spec).c_str());
+        throw_error_already_set();
+    }
+    pa.set_schedule(schedule);
+}
+
+//Describes why a Pix object converged, see PixConvergenceName
+std::string convergenceName(Pix& pa)
+{
+    return PixConvergenceName(pa.convergence());
+}
+
 BOOST_PYTHON_MODULE(pix)
 {    
+    enum_<PixStepStatus>("StepStatus")
+        .value("in_progress", kStepInProgress)
+        .value("iterated", kStepIterated)
+        .value("converged", kStepConverged)
+    ;
+    enum_<PaletteSeeding>("PaletteSeeding")
+        .value("split", kSeedSplit)
+        .value("kmeans_plus_plus", kSeedKMeansPlusPlus)
+        .value("histogram", kSeedHistogram)
+    ;
+    class_<ConvergenceCriteria>("ConvergenceCriteria")
+        .def_readwrite("max_churn", &ConvergenceCriteria::max_churn)
+        .def_readwrite("max_movement", &ConvergenceCriteria::max_movement)
+        .def_readwrite("patience", &ConvergenceCriteria::patience)
+        .def_readwrite("error_window", &ConvergenceCriteria::error_window)
+        .def_readwrite("window_tolerance", &ConvergenceCriteria::window_tolerance)
+    ;
     class_<Pix>("Pix", init<const cv::Mat&, int, int, int>())
         .def(init<std::string>())
         .def("initialize", &Pix::Initialize)
         .def("saveToFile", &Pix::SaveToFile)
         .def("iterate", &Pix::Iterate)
+        .def("step", &Pix::Step)
+        .def("setSchedule", &setScheduleByName)
         .add_property("converged", &Pix::hasConverged)
+        .add_property("convergence", &convergenceName)
+        .add_property("palette_seeding", &Pix::palette_seeding, &Pix::set_palette_seeding)
+        .add_property("palette_acceleration", &Pix::palette_acceleration, &Pix::set_palette_acceleration)
+        .add_property("binned_palette", &Pix::binned_palette, &Pix::set_binned_palette)
+        .def("setSparseAssociation", &Pix::set_sparse_association,
+             (arg("max_colors"), arg("epsilon") = kSparseEpsilon))
+        .add_property("sparse_association_colors", &Pix::sparse_association_colors)
+        .add_property("convergence_criteria",
+                      make_function(&Pix::convergence_criteria, return_value_policy<copy_const_reference>()),
+                      &Pix::set_convergence_criteria)
         .add_property("output_image", &createNumpyNdArrayFromOutputImage)
     ;
     
@@ -0,0 +1,244 @@
+#include "commands.h"
+#include "job.h"
+#include "jobargs.h"
+#include "manifest.h"
+#include "pipeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <tclap/CmdLine.h>
+
+//Collects the images to process. input is either a directory, in which
+//case all image files in it are used, or a text file listing one image
+//path per line. Returns false if input is neither.
+static bool ListInputs(const std::string& input, std::vector<std::string>& files) {
+    struct stat info;
+    if(stat(input.c_str(), &info) != 0)
+        return false;
+
+    if(S_ISDIR(info.st_mode)) {
+        std::vector<std::string> extensions;
+        extensions.push_back(".png");
+        extensions.push_back(".jpg");
+        extensions.push_back(".jpeg");
+        extensions.push_back(".bmp");
+        extensions.push_back(".tif");
+        extensions.push_back(".tiff");
+        extensions.push_back(".ppm");
+        extensions.push_back(".webp");
+        DIR* dir = opendir(input.c_str());
+        if(!dir)
+            return false;
+        while(struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            std::string lower = name;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            if(endsWith(lower, extensions))
+                files.push_back(input + "/" + name);
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        return true;
+    }
+
+    std::ifstream list(input.c_str());
+    std::string line;
+    while(std::getline(list, line)) {
+        if(!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if(!line.empty())
+            files.push_back(line);
+    }
+    return true;
+}
+
+//Returns the path of the output image for inputfile: the input's base name
+//with the extension replaced by format, inside outdir.
+static std::string OutputPath(const std::string& outdir, const std::string& inputfile,
+                              const std::string& format) {
+    std::string name = inputfile.substr(inputfile.find_last_of('/') + 1);
+    size_t dot = name.find_last_of('.');
+    if(dot != std::string::npos && dot > 0)
+        name.erase(dot);
+    return outdir + "/" + name + format;
+}
+
+//Prints the result of one image. Called from several threads.
+static void Report(const std::string& inputfile, const JobResult& result) {
+    static std::mutex output_mutex;
+    std::lock_guard<std::mutex> lock(output_mutex);
+    std::cout << (result.ok ? (result.cached ? "cached " : "ok     ") : "failed ") << inputfile
+              << " (" << result.iterations << " iterations, "
+              << (long)result.wall_ms << " ms";
+    if(!result.stop_reason.empty())
+        std::cout << ", " << result.stop_reason;
+    std::cout << ")";
+    if(!result.ok)
+        std::cout << ": " << result.error;
+    std::cout << std::endl;
+}
+
+int BatchMain(int argc, char* argv[]) {
+    std::string input;
+    std::string outdir;
+    std::string manifest_path;
+    std::string format;
+    int jobs;
+    bool pipeline;
+    PipelineOptions pipeline_options;
+    JobParams params;
+    ResultCache* cache;
+
+    try {
+        TCLAP::CmdLine cmd("Processes every image of a directory or file list, running several images concurrently. Completed images are recorded in a manifest and skipped when the batch is rerun.", ' ', "1.0");
+        TCLAP::UnlabeledValueArg<std::string> input_arg("in", "input directory, or a file listing one image path per line", true, "", "input");
+        TCLAP::UnlabeledValueArg<int> target_width_arg("width", "Output width. You can specify 0 to let the width be determined by the height and reproducing the width:height ratio of each input image", true, 0, "width");
+        TCLAP::UnlabeledValueArg<int> target_height_arg("height", "Output height. You can specify 0 to let the height be determined by the width and reproducing the width:height ratio of each input image", true, 0, "height");
+        TCLAP::UnlabeledValueArg<int> target_numcolors_arg("numcolors", "Output number colors", true, 0, "number colors");
+        TCLAP::ValueArg<std::string> outdir_arg("d", "outdir", "output directory", true, "", "directory");
+        TCLAP::ValueArg<std::string> manifest_arg("", "manifest", "manifest file, defaults to manifest.tsv in the output directory", false, "", "filename");
+        TCLAP::ValueArg<std::string> format_arg("", "format", "Extension and format of the output images", false, ".png", "extension");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of threads, 0 uses one per core. They process several images at a time and share the work of large images", false, 0, "number jobs");
+        TCLAP::SwitchArg pipeline_arg("", "pipeline", "Overlap decoding, computing and encoding in a three stage pipeline. -j then sets the number of compute threads", false);
+        TCLAP::ValueArg<int> decoders_arg("", "decoders", "Number of decode threads with --pipeline", false, 1, "number threads");
+        TCLAP::ValueArg<int> encoders_arg("", "encoders", "Number of encode threads with --pipeline", false, 1, "number threads");
+        TCLAP::ValueArg<int> queue_arg("", "queue", "Capacity of the queues between the stages with --pipeline", false, 4, "number images");
+        JobArgs job_args;
+        CacheArgs cache_args;
+        cmd.add(input_arg);
+        cmd.add(target_width_arg);
+        cmd.add(target_height_arg);
+        cmd.add(target_numcolors_arg);
+        cmd.add(outdir_arg);
+        cmd.add(manifest_arg);
+        cmd.add(format_arg);
+        cmd.add(jobs_arg);
+        cmd.add(pipeline_arg);
+        cmd.add(decoders_arg);
+        cmd.add(encoders_arg);
+        cmd.add(queue_arg);
+        job_args.AddTo(cmd);
+        cache_args.AddTo(cmd);
+
+        cmd.parse( argc, argv );
+
+        input = input_arg.getValue();
+        params.width = target_width_arg.getValue();
+        params.height = target_height_arg.getValue();
+        if(params.width == 0 && params.height == 0) {
+            std::cerr << "You cannot specify 0 for both width and height" << std::endl;
+            return 1;
+        }
+        params.numcolors = target_numcolors_arg.getValue();
+        outdir = outdir_arg.getValue();
+        manifest_path = manifest_arg.getValue();
+        if(manifest_path.empty())
+            manifest_path = outdir + "/manifest.tsv";
+        format = format_arg.getValue();
+        jobs = jobs_arg.getValue();
+        if(jobs <= 0)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+        pipeline = pipeline_arg.getValue();
+        pipeline_options.decoders = std::max(1, decoders_arg.getValue());
+        pipeline_options.workers = jobs;
+        pipeline_options.encoders = std::max(1, encoders_arg.getValue());
+        pipeline_options.queue_capacity = std::max(1, queue_arg.getValue());
+        job_args.Get(params);
+        cache = cache_args.Create();
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    if(!ListInputs(input, files)) {
+        std::cerr << "Could not read the input directory or list " << input << std::endl;
+        return 1;
+    }
+    mkdir(outdir.c_str(), 0777);
+    Manifest manifest;
+    //a rerun with other parameters or another format redoes every image
+    if(!manifest.Open(manifest_path, FormatParams(params) + "format=" + format + "\n")) {
+        std::cerr << "Could not open the manifest " << manifest_path << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> pending;
+    for(size_t i = 0; i < files.size(); ++i) {
+        if(!manifest.IsCompleted(files[i]))
+            pending.push_back(files[i]);
+    }
+    std::cout << pending.size() << " of " << files.size() << " images to process, "
+              << (files.size() - pending.size()) << " already completed" << std::endl;
+
+    //The workers do all the parallel work here; keep OpenCV from adding its
+    //own threads on top of them.
+    if(jobs > 1 || pipeline)
+        cv::setNumThreads(1);
+
+    std::atomic<int> failures(0);
+    if(pipeline) {
+        std::vector<PipelineJob> pipeline_jobs(pending.size());
+        for(size_t i = 0; i < pending.size(); ++i) {
+            pipeline_jobs[i].inputfile = pending[i];
+            pipeline_jobs[i].outputfile = OutputPath(outdir, pending[i], format);
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<StageStats> stats = RunPipeline(pipeline_jobs, params,
+            pipeline_options, manifest, cache,
+            [&](const PipelineJob& job, const JobResult& result) {
+                if(!result.ok)
+                    failures++;
+                Report(job.inputfile, result);
+            });
+        PrintStageStats(std::cout, stats, std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count());
+        delete cache;
+        return failures == 0 ? 0 : 1;
+    }
+
+    //Images and the stages within them share one work-stealing pool:
+    //threads start new images while there are any, then help with the
+    //images still running. Starting with the largest files keeps a big
+    //image from being the only one left at the end.
+    std::vector<std::pair<off_t, std::string> > by_size;
+    for(size_t i = 0; i < pending.size(); ++i) {
+        struct stat info;
+        by_size.push_back(std::make_pair(
+            stat(pending[i].c_str(), &info) == 0 ? info.st_size : 0, pending[i]));
+    }
+    std::stable_sort(by_size.begin(), by_size.end(),
+        [](const std::pair<off_t, std::string>& a, const std::pair<off_t, std::string>& b) {
+            return a.first > b.first;
+        });
+
+    //the calling thread only waits in ParallelFor, the pool does all work
+    ExecutorPtr executor = SerialExecutor::Shared();
+    if(jobs > 1)
+        executor = ExecutorPtr(new ThreadPoolExecutor(jobs));
+    executor->ParallelFor(by_size.size(), [&](int n) {
+        const std::string& inputfile = by_size[n].second;
+        JobResult result = ProcessFile(inputfile,
+            OutputPath(outdir, inputfile, format), params, cache, executor);
+        manifest.Record(inputfile, result);
+        if(!result.ok)
+            failures++;
+        Report(inputfile, result);
+    });
+    delete cache;
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+//A bounded, lock-free multi-producer/multi-consumer queue (D. Vyukov's
+//array based design). Each cell carries a sequence number that tells
+//producers and consumers whether the cell is free for the current lap, so
+//neither side ever takes a lock. TryPush fails when the queue is full, which
+//is how callers apply backpressure.
+template<typename T>
+class BoundedQueue {
+ public:
+    //capacity is rounded up to the next power of two
+    explicit BoundedQueue(size_t capacity) : enqueue_pos_(0), dequeue_pos_(0) {
+        size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+        mask_ = size - 1;
+        cells_ = new Cell[size];
+        for(size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~BoundedQueue() {
+        delete[] cells_;
+    }
+
+    //Adds value to the queue. Returns false if the queue is full.
+    bool TryPush(const T& value) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while(true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+            if(diff == 0) {
+                if(enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed))
+                    break;
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //Removes the oldest value from the queue. Returns false if it is empty.
+    bool TryPop(T& value) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while(true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+            if(diff == 0) {
+                if(dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed))
+                    break;
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    //returns the number of queued values. Only a snapshot while other
+    //threads are pushing or popping.
+    size_t SizeApprox() const {
+        size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+ private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    Cell* cells_;
+    size_t mask_;
+    //keep the producer and consumer positions on separate cache lines
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) std::atomic<size_t> dequeue_pos_;
+};
@@ -0,0 +1,234 @@
+#include "commands.h"
+#include "framing.h"
+#include "jobargs.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <tclap/CmdLine.h>
+
+//Reads a whole file into bytes. A file name of "-" reads stdin.
+static bool ReadFile(const std::string& path, std::vector<unsigned char>& bytes) {
+    if(path == "-")
+        return ReadAll(STDIN_FILENO, bytes);
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    bool ok = ReadAll(fd, bytes);
+    close(fd);
+    return ok;
+}
+
+//Writes bytes to a file. A file name of "-" writes to stdout.
+static bool WriteFile(const std::string& path, const std::vector<unsigned char>& bytes) {
+    if(path == "-")
+        return bytes.empty() || WriteAll(STDOUT_FILENO, &bytes[0], bytes.size());
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0)
+        return false;
+    bool ok = bytes.empty() || WriteAll(fd, &bytes[0], bytes.size());
+    return close(fd) == 0 && ok;
+}
+
+//Arguments shared by the client and the load test: the socket, the input
+//image and the job parameters.
+class RequestArgs {
+ public:
+    RequestArgs()
+        : socket_arg("", "socket", "path of the daemon's Unix domain socket, by default pix.sock in $XDG_RUNTIME_DIR or /tmp", false, DefaultSocketPath(), "path"),
+          input_arg("in", "input filename, - reads the encoded image from stdin", true, "", "input filename"),
+          target_width_arg("width", "Output width, 0 keeps the aspect ratio", true, 0, "width"),
+          target_height_arg("height", "Output height, 0 keeps the aspect ratio", true, 0, "height"),
+          target_numcolors_arg("numcolors", "Output number colors", true, 0, "number colors"),
+          format_arg("", "format", "Format of the output image", false, ".png", "extension"),
+          by_path_arg("", "by-path", "Send the input path instead of the image data, the daemon reads the file itself", false) {
+    }
+
+    void AddTo(TCLAP::CmdLine& cmd) {
+        cmd.add(socket_arg);
+        cmd.add(input_arg);
+        cmd.add(target_width_arg);
+        cmd.add(target_height_arg);
+        cmd.add(target_numcolors_arg);
+        cmd.add(format_arg);
+        cmd.add(by_path_arg);
+        job_args.AddTo(cmd);
+    }
+
+    //builds the request. Returns false if the input cannot be read.
+    bool Get(std::string& socket_path, DaemonRequest& request) {
+        socket_path = socket_arg.getValue();
+        request.params.width = target_width_arg.getValue();
+        request.params.height = target_height_arg.getValue();
+        request.params.numcolors = target_numcolors_arg.getValue();
+        job_args.Get(request.params);
+        request.format = format_arg.getValue();
+        if(by_path_arg.getValue()) {
+            request.path = input_arg.getValue();
+            return true;
+        }
+        if(!ReadFile(input_arg.getValue(), request.image) || request.image.empty()) {
+            std::cerr << "Could not read " << input_arg.getValue() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+ private:
+    TCLAP::ValueArg<std::string> socket_arg;
+    TCLAP::UnlabeledValueArg<std::string> input_arg;
+    TCLAP::UnlabeledValueArg<int> target_width_arg;
+    TCLAP::UnlabeledValueArg<int> target_height_arg;
+    TCLAP::UnlabeledValueArg<int> target_numcolors_arg;
+    TCLAP::ValueArg<std::string> format_arg;
+    TCLAP::SwitchArg by_path_arg;
+    JobArgs job_args;
+};
+
+int ClientMain(int argc, char* argv[]) {
+    std::string socket_path;
+    std::string outputfile;
+    DaemonRequest request;
+
+    try {
+        TCLAP::CmdLine cmd("Sends an image to a running 'pix daemon' and writes the result.", ' ', "1.0");
+        RequestArgs request_args;
+        TCLAP::ValueArg<std::string> output_arg("o", "out", "output filename, - writes the encoded image to stdout", true, "", "filename");
+        request_args.AddTo(cmd);
+        cmd.add(output_arg);
+
+        cmd.parse( argc, argv );
+
+        if(!request_args.Get(socket_path, request))
+            return 1;
+        outputfile = output_arg.getValue();
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    int fd = ConnectUnix(socket_path);
+    if(fd < 0) {
+        std::cerr << "Could not connect to " << socket_path << std::endl;
+        return 1;
+    }
+    DaemonResponse response;
+    bool exchanged = SendRequest(fd, request) && ReadResponse(fd, response);
+    close(fd);
+    if(!exchanged) {
+        std::cerr << "The connection to the daemon was lost" << std::endl;
+        return 1;
+    }
+    if(response.status != "ok") {
+        std::cerr << response.status << ": " << response.message << std::endl;
+        return 1;
+    }
+    if(!WriteFile(outputfile, response.image)) {
+        std::cerr << "Could not write " << outputfile << std::endl;
+        return 1;
+    }
+    std::cerr << response.iterations << " iterations, " << (long)response.wall_ms
+              << " ms" << (response.truncated ? ", cut short by the deadline" : "")
+              << std::endl;
+    return 0;
+}
+
+int LoadTestMain(int argc, char* argv[]) {
+    std::string socket_path;
+    DaemonRequest request;
+    int num_requests;
+    int connections;
+
+    try {
+        TCLAP::CmdLine cmd("Measures throughput and latency of a running 'pix daemon' by sending the same image repeatedly over several connections.", ' ', "1.0");
+        RequestArgs request_args;
+        TCLAP::ValueArg<int> requests_arg("n", "requests", "Total number of requests", false, 100, "number requests");
+        TCLAP::ValueArg<int> connections_arg("", "connections", "Number of concurrent connections", false, 4, "number connections");
+        request_args.AddTo(cmd);
+        cmd.add(requests_arg);
+        cmd.add(connections_arg);
+
+        cmd.parse( argc, argv );
+
+        if(!request_args.Get(socket_path, request))
+            return 1;
+        num_requests = requests_arg.getValue();
+        connections = std::max(1, connections_arg.getValue());
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    std::atomic<int> next(0);
+    std::atomic<int> ok(0), busy(0), failed(0);
+    std::vector<double> latencies;
+    std::mutex latencies_mutex;
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < connections; ++i) {
+        threads.push_back(std::thread([&]() {
+            int fd = ConnectUnix(socket_path);
+            if(fd < 0) {
+                std::cerr << "Could not connect to " << socket_path << std::endl;
+                return;
+            }
+            while(next++ < num_requests) {
+                Clock::time_point sent = Clock::now();
+                DaemonResponse response;
+                if(!SendRequest(fd, request) || !ReadResponse(fd, response)) {
+                    failed++;
+                    break;
+                }
+                double latency = std::chrono::duration<double, std::milli>(
+                    Clock::now() - sent).count();
+                if(response.status == "ok") {
+                    ok++;
+                    std::lock_guard<std::mutex> lock(latencies_mutex);
+                    latencies.push_back(latency);
+                } else if(response.status == "busy") {
+                    busy++;
+                } else {
+                    failed++;
+                }
+            }
+            close(fd);
+        }));
+    }
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    double wall_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << ok << " ok, " << busy << " busy, " << failed << " failed in "
+              << std::fixed << std::setprecision(2) << wall_s << " s ("
+              << ok / wall_s << " images/s)" << std::endl;
+    if(!latencies.empty()) {
+        const double percentiles[] = {0.5, 0.95, 0.99, 1.0};
+        const char* names[] = {"p50", "p95", "p99", "max"};
+        std::cout << "latency";
+        for(int i = 0; i < 4; ++i) {
+            size_t index = std::min(latencies.size() - 1,
+                (size_t)(percentiles[i] * latencies.size()));
+            std::cout << " " << names[i] << "=" << latencies[index] << "ms";
+        }
+        std::cout << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -1,162 +1,315 @@
 #include "pix.h"
+#include "job.h"
+#include "jobargs.h"
+#include "framing.h"
+#include "commands.h"
 
+#include <chrono>
+#include <csignal>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
 #include <string>
 #include <vector>
 
+#include <unistd.h>
+
 #include <tclap/CmdLine.h>
 
 const char* pix_cmline_version = "1.0";
 
+//file name used on the command line to refer to stdin or stdout
+const char* kStdStream = "-";
+
+//cancelled by SIGINT while the algorithm runs
+static PixCancelToken interrupted;
+
+static void OnInterrupt(int) {
+    interrupted.Cancel();
+}
+
+//Decodes the input image. An input file name of "-" reads the encoded
+//image from stdin.
+static cv::Mat ReadInput(const std::string& inputfile, int flags) {
+    if(inputfile != kStdStream)
+        return cv::imread(inputfile, flags);
+    std::vector<unsigned char> bytes;
+    if(!ReadAll(STDIN_FILENO, bytes) || bytes.empty())
+        return cv::Mat();
+    return cv::imdecode(cv::Mat(bytes), flags);
+}
+
+//Writes an image to a file. A file name of "-" writes the image to stdout,
+//encoded in the given format (an extension such as ".png").
+static bool WriteOutput(const std::string& outputfile, const std::string& format,
+                        const cv::Mat& img) {
+    if(outputfile != kStdStream)
+        return imwrite(outputfile, img);
+    std::vector<unsigned char> bytes;
+    if(!cv::imencode(format, img, bytes))
+        return false;
+    return WriteAll(STDOUT_FILENO, &bytes[0], bytes.size());
+}
+
+//Framed multi-image mode: reads frames of encoded images from stdin and
+//answers each with a frame holding the encoded output image (see
+//framing.h). A failed image is answered with an empty frame. Runs until
+//stdin is closed.
+static int RunStream(const JobParams& params, const std::string& format,
+                     ResultCache* cache) {
+    std::vector<unsigned char> frame;
+    int failures = 0;
+    while(ReadFrame(STDIN_FILENO, frame)) {
+        cv::Mat decoded;
+        if(!frame.empty())
+            decoded = cv::imdecode(cv::Mat(frame), DecodeFlags(params));
+
+        cv::Mat output;
+        JobResult result = ProcessImage(decoded, params, output, cache, ExecutorPtr());
+        std::string error = result.error;
+        std::vector<unsigned char> encoded;
+        if(result.ok && !cv::imencode(format, output, encoded)) {
+            error = "Could not encode the output image as " + format;
+            encoded.clear();
+        }
+        if(!error.empty()) {
+            std::cerr << "error: " << error << std::endl;
+            failures++;
+        }
+        if(!WriteFrame(STDOUT_FILENO, encoded)) {
+            std::cerr << "error: could not write to stdout" << std::endl;
+            return 1;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
+    //subcommands
+    if(argc > 1 && strcmp(argv[1], "batch") == 0)
+        return BatchMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "daemon") == 0)
+        return DaemonMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "client") == 0)
+        return ClientMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "loadtest") == 0)
+        return LoadTestMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "watch") == 0)
+        return WatchMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "sweep") == 0)
+        return SweepMain(argc - 1, argv + 1);
+    if(argc > 1 && strcmp(argv[1], "stress") == 0)
+        return StressMain(argc - 1, argv + 1);
+
     //See commandline argument descriptions for the meaning and defaults of the following option variables
     //Input spec
     std::string inputfile;
-    bool use_alpha; 
-    //Algorithm main args
-    int target_width;
-    int target_height;
-    int target_numcolors;
+    //Algorithm main args and fine-tuning
+    JobParams params;
     //Output spec
-    bool show; 
+    bool show;
     std::string outputfile;
-    //Algorithm fine-tuning
-    int slic_factor;
-    float saturation;
-    float smooth_factor;
-    float sigma_color;
-    float sigma_position;
-    
-    int max_iter;
-    
+    std::string format;
+    bool stream;
+    bool verbose;
+    int upscale;
+    int threads;
+    std::string upscaled_outputfile;
+    std::string superpixel_outputfile;
+    std::string region_outputfile;
+    ResultCache* cache;
+
     try {
-        TCLAP::CmdLine cmd("Scales down resolution and color palette size of an image, using Timothy Gerstner's PIX algorithm.", ' ', pix_cmline_version);
-        TCLAP::UnlabeledValueArg<std::string> input_arg("in", "input filename", true, "", "input filename");
+        TCLAP::CmdLine cmd("Scales down resolution and color palette size of an image, using Timothy Gerstner's PIX algorithm. Subcommands: batch, daemon, client, loadtest, watch, sweep (see 'pix <subcommand> --help').", ' ', pix_cmline_version);
+        TCLAP::UnlabeledValueArg<std::string> input_arg("in", "input filename, - reads the encoded image from stdin", true, "", "input filename");
         TCLAP::UnlabeledValueArg<int> target_width_arg("width", "Output width. You can specify 0 to let the width be determined by the height and reproducing the width:height ratio of the input image", true, 0, "width");
         TCLAP::UnlabeledValueArg<int> target_height_arg("height", "Output height. You can specify 0 to let the height be determined by the width and reproducing the width:height ratio of the input image", true, 0, "height");
         TCLAP::UnlabeledValueArg<int> target_numcolors_arg("numcolors", "Output number colors", true, 0, "number colors");
-        TCLAP::ValueArg<std::string> output_arg("o", "out", "output filename", false, "", "filename");
-        TCLAP::ValueArg<int> maxiter_arg("m", "max-iterations", "Maximum number of iterations", false, 128, "number iterations");
-        
-        TCLAP::ValueArg<int> slic_factor_arg("l", "slic-factor", "SLIC factor", false, 45, "integer value");
-        TCLAP::ValueArg<float> saturation_arg("t", "saturation", "Saturation value", false, 1.1f, "floating point value");
-        TCLAP::ValueArg<float> smooth_factor_arg("f", "smooth-factor", "Smooth factor", false, 0.1f, "floating point value");
-        TCLAP::ValueArg<float> sigma_color_arg("c", "sigma", "Sigma value (color)", false, 2.0f, "floating point value");        
-        TCLAP::ValueArg<float> sigma_position_arg("p", "sigmap", "Sigma value (position)", false, 0.97f, "floating point value");
-        
-        TCLAP::SwitchArg use_alpha_arg("a","use-alpha","Use Alpha-Channel for Importance Sampling", false);
+        TCLAP::ValueArg<std::string> output_arg("o", "out", "output filename, - writes the encoded image to stdout", false, "", "filename");
+        TCLAP::ValueArg<std::string> format_arg("", "format", "Image format used when writing to stdout", false, ".png", "extension");
+        TCLAP::SwitchArg stream_arg("", "stream", "Framed multi-image mode: reads length prefixed encoded images from stdin until it is closed and writes a length prefixed output image to stdout for each of them. The input filename has to be -", false);
+        TCLAP::ValueArg<int> upscale_arg("u", "upscale", "Integer factor used for the upscaled output (shown with --show or written with --upscaled-out)", false, 4, "factor");
+        TCLAP::ValueArg<std::string> upscaled_output_arg("", "upscaled-out", "output filename for the upscaled output image", false, "", "filename");
+        TCLAP::ValueArg<std::string> superpixel_output_arg("", "superpixel-out", "output filename for the superpixel mean color image", false, "", "filename");
+        TCLAP::ValueArg<int> threads_arg("j", "threads", "Number of threads working on the image, 0 uses one per core", false, 0, "number threads");
+        TCLAP::ValueArg<std::string> region_output_arg("", "region-out", "output filename for the input image with superpixel boundaries", false, "", "filename");
+        TCLAP::SwitchArg verbose_arg("v", "verbose", "Print the temperature, palette error, number of colors, assignment churn and superpixel movement after every iteration instead of a dot, and why the run stopped", false);
+        JobArgs job_args;
+        CacheArgs cache_args;
+
         TCLAP::SwitchArg show_arg("s","show","Show the result in a modal dialogue", false);
         cmd.add(input_arg);
         cmd.add(target_width_arg);
         cmd.add(target_height_arg);
         cmd.add(target_numcolors_arg);
-        cmd.add(use_alpha_arg);
         cmd.add(show_arg);
         cmd.add(output_arg);
-        cmd.add(maxiter_arg);
-        cmd.add(slic_factor_arg);
-        cmd.add(saturation_arg);
-        cmd.add(smooth_factor_arg);
-        cmd.add(sigma_color_arg);
-        cmd.add(sigma_position_arg);
-        
+        cmd.add(format_arg);
+        cmd.add(stream_arg);
+        cmd.add(upscale_arg);
+        cmd.add(upscaled_output_arg);
+        cmd.add(superpixel_output_arg);
+        cmd.add(region_output_arg);
+        cmd.add(threads_arg);
+        cmd.add(verbose_arg);
+        job_args.AddTo(cmd);
+        cache_args.AddTo(cmd);
+
         cmd.parse( argc, argv );
-        
-        inputfile = input_arg.getValue();        
-        target_width = target_width_arg.getValue();
-        target_height = target_height_arg.getValue();
-        if(target_width == 0 && target_height == 0) {
+
+        inputfile = input_arg.getValue();
+        params.width = target_width_arg.getValue();
+        params.height = target_height_arg.getValue();
+        if(params.width == 0 && params.height == 0) {
             std::cerr << "You cannot specify 0 for both width and height" << std::endl;
             return 1;
-        }        
-        target_numcolors = target_numcolors_arg.getValue();
-        use_alpha = use_alpha_arg.getValue();      
-        outputfile = output_arg.getValue(); 
-        show = show_arg.getValue(); 
-        max_iter = maxiter_arg.getValue();
-        slic_factor = slic_factor_arg.getValue();
-        saturation = saturation_arg.getValue();
-        smooth_factor = smooth_factor_arg.getValue();
-        sigma_color = sigma_color_arg.getValue();
-        sigma_position = sigma_position_arg.getValue();
+        }
+        params.numcolors = target_numcolors_arg.getValue();
+        outputfile = output_arg.getValue();
+        format = format_arg.getValue();
+        stream = stream_arg.getValue();
+        if(stream && inputfile != kStdStream) {
+            std::cerr << "--stream reads its input from stdin, specify - as input filename" << std::endl;
+            return 1;
+        }
+        show = show_arg.getValue();
+        upscale = upscale_arg.getValue();
+        if(upscale < 1) {
+            std::cerr << "The upscale factor has to be at least 1" << std::endl;
+            return 1;
+        }
+        upscaled_outputfile = upscaled_output_arg.getValue();
+        superpixel_outputfile = superpixel_output_arg.getValue();
+        region_outputfile = region_output_arg.getValue();
+        threads = threads_arg.getValue();
+        verbose = verbose_arg.getValue();
+        job_args.Get(params);
+        cache = cache_args.Create();
     }
     // catch any cmdline exceptions
-    catch (TCLAP::ArgException &e) { 
+    catch (TCLAP::ArgException &e) {
         std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
         return 1;
-    }    
-        
-    cv::Mat imagei;
-    //reads Image as 3 CV_8UC3
-    imagei = cv::imread(inputfile, CV_LOAD_IMAGE_COLOR);
-    if(!imagei.data)
+    }
+
+    if(stream)
+        return RunStream(params, format, cache);
+
+    //keep stdout clean for the image data when writing the result there
+    std::ostream& progress = (outputfile == kStdStream) ? std::cerr : std::cout;
+    //--deadline counts from here
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    cv::Mat decoded = ReadInput(inputfile, DecodeFlags(params));
+    cv::Mat image, weights;
+    std::string error;
+    if(!PrepareInput(decoded, params, image, weights, error))
     {
-        std::cerr << "Could not open or find the image" << std::endl;
+        std::cerr << error << std::endl;
         return 1;
     }
-    
-    //Pix expected an image in CV_32FC3 format
-    cv::Mat image(cv::Size(imagei.cols, imagei.rows), CV_32FC3);
-    imagei.convertTo(image, CV_32FC3, 1/255.0);   
-    
-    //Invalid case of width == height == 0 is managed above
-    if(target_width == 0)
-        target_width = target_height * (static_cast<double>(imagei.cols) / imagei.rows);
-    else if (target_height == 0)
-         target_height = target_width * (static_cast<double>(imagei.rows) / imagei.cols);
-    
-    Pix pix(image, target_width, target_height, target_numcolors);    
-    
-    if(use_alpha) {        
-        cv::Mat image_full;
-        image_full = cv::imread(inputfile, -1); //-1 loads the image as is (including alpha channel)
-        if(image_full.channels() != 4) {
-            std::cerr << "Trying to use alpha channel as importance map, but image has no alpha channel" << std::endl;
-            return 1;
+
+    //the superpixel and region images need the algorithm state, which the
+    //cache does not keep
+    if(!superpixel_outputfile.empty() || !region_outputfile.empty()) {
+        delete cache;
+        cache = NULL;
+    }
+    std::string cache_key;
+    PixResult cached_result;
+    bool cached = false;
+    if(cache) {
+        //the key uses the parameters as given, before the size is resolved,
+        //like ProcessImage
+        cache_key = CacheKey(decoded, params);
+        cached = cache->Lookup(cache_key, cached_result);
+    }
+
+    if(!ResolveOutputSize(params, image.cols, image.rows, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    Pix* pix = NULL;
+    bool truncated = false;
+    if(!cached) {
+        ExecutorPtr executor;
+        if(threads != 1)
+            executor = ExecutorPtr(new ThreadPoolExecutor(threads));
+        pix = CreatePix(PixInput::FromRgb(image, weights), params, executor);
+        //Ctrl-C cancels the run within a few milliseconds; nothing is
+        //written then
+        signal(SIGINT, OnInterrupt);
+        PixRunStatus status = RunPix(*pix, params, start, [&](const PixProgress& report) {
+            if(verbose) {
+                progress << "iteration " << report.iteration
+                         << ": temperature " << report.temperature
+                         << ", palette error " << report.palette_error
+                         << ", " << report.palette_size << " colors"
+                         << ", churn " << report.assignment_churn
+                         << ", movement " << report.superpixel_movement << std::endl;
+            } else {
+                progress << "." << std::flush;
+            }
+        }, &interrupted);
+        signal(SIGINT, SIG_DFL);
+        if(!verbose)
+            progress << std::endl;
+        if(interrupted.cancelled()) {
+            std::cerr << "Cancelled" << std::endl;
+            delete pix;
+            delete cache;
+            return 130;
         }
-        cv::Mat alpha_int = cv::Mat(cv::Size(image.cols, image.rows), CV_8UC1, cv::Scalar(255));
-        CvMat tmp = image_full;
-        cv::extractImageCOI(&tmp, alpha_int, 3); //extract alpha channel
-        cv::Mat input_weights = cv::Mat(cv::Size(image.cols, image.rows), 
-                                CV_32FC1, cv::Scalar(1.0f));
-        alpha_int.convertTo(alpha_int, CV_32FC1, 1/255.0);
-        
-        pix.set_input_weights(input_weights);
+        truncated = status == kRunDeadline;
+        if(truncated)
+            progress << "Deadline reached, using the best result so far" << std::endl;
+        else if(verbose)
+            progress << "Stopped: " << StopReason(*pix, status) << std::endl;
     }
-        
-    pix.SetBilateralParams(sigma_color, sigma_position);
-    pix.set_laplacian_factor(smooth_factor);
-    pix.setSlicFact(slic_factor);    
-    pix.SetSaturation(saturation);    
-    
-    pix.Initialize();
-        
-    int num_iterations = 0;
-    while(!pix.hasConverged() && num_iterations < max_iter)
-    {        
-        num_iterations += 1;
-        std::cout << ".";  
-        std::cout.flush();              
-        pix.Iterate();        
-        pix.SaveState();        
+
+    //render every requested artifact in a single pass
+    cv::Mat output, output_big, superpixel_img, region_img;
+    PixOutputs outputs;
+    outputs.output = &output;
+    if(show || !upscaled_outputfile.empty()) {
+        outputs.upscaled = &output_big;
+        outputs.upscale_factor = upscale;
+    }
+    if(!superpixel_outputfile.empty())
+        outputs.superpixel = &superpixel_img;
+    if(!region_outputfile.empty())
+        outputs.region = &region_img;
+    if(cached) {
+        Pix::RenderResult(cached_result, outputs);
+    } else {
+        pix->RenderOutputs(outputs);
+        //a result cut short depends on the timing of the run
+        if(cache && !truncated) {
+            PixResult result;
+            pix->GetResult(result);
+            cache->Store(cache_key, result);
+        }
+        delete pix;
     }
-    std::cout << std::endl;
-        
-    cv::Mat result;
-    pix.GetOutputImage(result);  //GetRegionImage //GetSuperpixelImage //GetOutputImage
-    cv::Mat result_big(cv::Size(result.cols*4, result.rows*4), CV_8UC3);
-    cv::resize(result, result_big, cv::Size(result.cols*4, result.rows*4), 0, 0, CV_INTER_NN);
-    
+    delete cache;
+
     if(show) {
-        cv::imshow( "Display window", result_big);
-        cv::waitKey(0);  
+        cv::imshow( "Display window", output_big);
+        cv::waitKey(0);
     }
-    
-    cv::Mat output(cv::Size(target_width, target_height), CV_32FC3);
-    pix.GetOutputImage(output);    
-    imwrite(outputfile, output);
-    
+
+    if(!outputfile.empty() && !WriteOutput(outputfile, format, output)) {
+        std::cerr << "Could not write the output image" << std::endl;
+        return 1;
+    }
+    if(!upscaled_outputfile.empty())
+        WriteOutput(upscaled_outputfile, format, output_big);
+    if(!superpixel_outputfile.empty())
+        WriteOutput(superpixel_outputfile, format, superpixel_img);
+    if(!region_outputfile.empty())
+        WriteOutput(region_outputfile, format, region_img);
+
     return 0;
 }
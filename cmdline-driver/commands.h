@@ -0,0 +1,25 @@
+#pragma once
+
+//Entry points of the driver's subcommands. Each takes the command line with
+//the subcommand name as argv[0] and returns the process exit code.
+
+//pix batch: processes a directory or a list of images on a worker pool
+int BatchMain(int argc, char* argv[]);
+
+//pix daemon: serves requests on a Unix domain socket with warm workers
+int DaemonMain(int argc, char* argv[]);
+
+//pix client: sends a single image to a running daemon
+int ClientMain(int argc, char* argv[]);
+
+//pix loadtest: measures throughput and latency of a running daemon
+int LoadTestMain(int argc, char* argv[]);
+
+//pix watch: processes the jobs dropped into a spool directory
+int WatchMain(int argc, char* argv[]);
+
+//pix sweep: runs many parameter combinations on one image
+int SweepMain(int argc, char* argv[]);
+
+//pix stress: checks concurrent instances against serial runs
+int StressMain(int argc, char* argv[]);
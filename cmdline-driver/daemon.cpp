@@ -0,0 +1,249 @@
+#include "commands.h"
+#include "job.h"
+#include "jobargs.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <tclap/CmdLine.h>
+
+//A request handed from a connection thread to a worker. The connection
+//thread waits until the worker marks it done.
+struct DaemonJob {
+    DaemonRequest request;
+    DaemonResponse response;
+    std::chrono::steady_clock::time_point received;
+    bool done;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    DaemonJob() : done(false) {}
+};
+
+//Bounded queue of jobs waiting for a worker. Connection threads never wait
+//for room: a full queue rejects the job so the client can back off.
+class JobQueue {
+ public:
+    explicit JobQueue(size_t capacity) : capacity_(capacity) {}
+
+    //returns false if the queue is full
+    bool TryPush(DaemonJob* job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(jobs_.size() >= capacity_)
+            return false;
+        jobs_.push_back(job);
+        available_.notify_one();
+        return true;
+    }
+
+    //waits for the next job
+    DaemonJob* Pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(jobs_.empty()) {
+            available_.wait(lock);
+        }
+        DaemonJob* job = jobs_.front();
+        jobs_.pop_front();
+        return job;
+    }
+
+ private:
+    size_t capacity_;
+    std::deque<DaemonJob*> jobs_;
+    std::mutex mutex_;
+    std::condition_variable available_;
+};
+
+//Limits the number of connections served at once. The accept loop waits
+//for a free slot, so further clients wait in the listen backlog instead of
+//each getting a thread.
+class ConnectionLimit {
+ public:
+    explicit ConnectionLimit(int max_connections) : free_(max_connections) {}
+
+    //waits until a connection may be served
+    void Acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(free_ == 0) {
+            released_.wait(lock);
+        }
+        free_--;
+    }
+
+    void Release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_++;
+        released_.notify_one();
+    }
+
+ private:
+    int free_;
+    std::mutex mutex_;
+    std::condition_variable released_;
+};
+
+//Answers one job. Throws if the decoder or the algorithm does.
+static void RunJob(DaemonJob* job, cv::Mat& decoded, cv::Mat& output, ResultCache* cache) {
+    DaemonRequest& request = job->request;
+    DaemonResponse& response = job->response;
+
+    //imdecode writes into decoded, reusing its buffer when the size and
+    //type match. imread has no such overload and allocates every time.
+    if(!request.path.empty())
+        decoded = cv::imread(request.path, DecodeFlags(request.params));
+    else
+        cv::imdecode(cv::Mat(request.image), DecodeFlags(request.params), &decoded);
+    //the input bytes are no longer needed while the job iterates
+    std::vector<unsigned char>().swap(request.image);
+
+    //the deadline counts from the arrival of the request: take off the
+    //time spent in the queue and decoding, but always leave a little to
+    //answer with a condensed result
+    if(request.params.deadline_ms > 0) {
+        int waited = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - job->received).count();
+        request.params.deadline_ms = std::max(1, request.params.deadline_ms - waited);
+    }
+
+    JobResult result = ProcessImage(decoded, request.params, output, cache, ExecutorPtr());
+    response.iterations = result.iterations;
+    response.wall_ms = result.wall_ms;
+    response.truncated = result.truncated;
+    if(result.ok && !cv::imencode(request.format, output, response.image)) {
+        result.ok = false;
+        result.error = "Could not encode the output image as " + request.format;
+    }
+    response.status = result.ok ? "ok" : "error";
+    response.message = result.error;
+}
+
+//Runs jobs for the lifetime of the daemon. The decode and output buffers
+//live as long as the worker: images sent as data are decoded into the same
+//buffer, and outputs of the same size reuse theirs. cache may be NULL.
+static void Worker(JobQueue& queue, ResultCache* cache) {
+    cv::Mat decoded, output;
+    while(true) {
+        DaemonJob* job = queue.Pop();
+        //a job that throws fails alone, the worker goes on with the next one
+        try {
+            RunJob(job, decoded, output, cache);
+        } catch(const std::exception& e) {
+            job->response = DaemonResponse();
+            job->response.status = "error";
+            job->response.message = std::string("The job failed: ") + e.what();
+        } catch(...) {
+            job->response = DaemonResponse();
+            job->response.status = "error";
+            job->response.message = "The job failed";
+        }
+
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->done = true;
+        job->finished.notify_one();
+    }
+}
+
+//Serves the requests of one client connection until it is closed
+static void ServeConnection(int fd, JobQueue& queue, ConnectionLimit& limit) {
+    while(true) {
+        DaemonJob job;
+        std::string error;
+        if(!ReadRequest(fd, job.request, error))
+            break;
+        job.received = std::chrono::steady_clock::now();
+
+        if(!error.empty()) {
+            job.response.status = "error";
+            job.response.message = error;
+        } else if(!queue.TryPush(&job)) {
+            job.response.status = "busy";
+            job.response.message = "queue full";
+        } else {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            while(!job.done) {
+                job.finished.wait(lock);
+            }
+        }
+        if(!SendResponse(fd, job.response))
+            break;
+    }
+    close(fd);
+    limit.Release();
+}
+
+int DaemonMain(int argc, char* argv[]) {
+    std::string socket_path;
+    int workers;
+    int queue_capacity;
+    int max_connections;
+    ResultCache* cache;
+
+    try {
+        TCLAP::CmdLine cmd("Runs the algorithm as a long running daemon on a Unix domain socket. Use 'pix client' to send it images.", ' ', "1.0");
+        TCLAP::ValueArg<std::string> socket_arg("", "socket", "path of the Unix domain socket, by default pix.sock in $XDG_RUNTIME_DIR or /tmp", false, DefaultSocketPath(), "path");
+        TCLAP::ValueArg<int> workers_arg("j", "jobs", "Number of images processed concurrently, 0 uses one per core", false, 0, "number jobs");
+        TCLAP::ValueArg<int> queue_arg("", "queue", "Number of requests that may wait for a worker before requests are rejected as busy, 0 uses twice the number of jobs", false, 0, "number requests");
+        TCLAP::ValueArg<int> connections_arg("", "connections", "Number of client connections served at once, further clients wait to be accepted", false, 64, "number connections");
+        cmd.add(socket_arg);
+        cmd.add(workers_arg);
+        CacheArgs cache_args;
+        cmd.add(queue_arg);
+        cmd.add(connections_arg);
+        cache_args.AddTo(cmd);
+
+        cmd.parse( argc, argv );
+
+        socket_path = socket_arg.getValue();
+        workers = workers_arg.getValue();
+        if(workers <= 0)
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        queue_capacity = queue_arg.getValue();
+        if(queue_capacity <= 0)
+            queue_capacity = 2 * workers;
+        max_connections = std::max(1, connections_arg.getValue());
+        cache = cache_args.Create();
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    //a client that disconnects early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    if(workers > 1)
+        cv::setNumThreads(1);
+
+    int listen_fd = ListenUnix(socket_path, 64);
+    if(listen_fd < 0)
+        return 1;
+
+    JobQueue queue(queue_capacity);
+    ConnectionLimit limit(max_connections);
+    for(int i = 0; i < workers; ++i) {
+        std::thread(Worker, std::ref(queue), cache).detach();
+    }
+    std::cerr << "pix daemon listening on " << socket_path << " with " << workers
+              << " workers" << std::endl;
+
+    while(true) {
+        limit.Acquire();
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            limit.Release();
+            continue;
+        }
+        std::thread(ServeConnection, fd, std::ref(queue), std::ref(limit)).detach();
+    }
+}
@@ -0,0 +1,68 @@
+#include "framing.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+//Reads exactly size bytes. Returns false on end of file or error.
+static bool ReadExactly(int fd, unsigned char* data, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool ReadAll(int fd, std::vector<unsigned char>& bytes) {
+    bytes.clear();
+    unsigned char buffer[65536];
+    while(true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return false;
+        if(n == 0)
+            return true;
+        bytes.insert(bytes.end(), buffer, buffer + n);
+    }
+}
+
+bool WriteAll(int fd, const unsigned char* data, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool ReadFrame(int fd, std::vector<unsigned char>& payload, size_t max_size) {
+    unsigned char header[4];
+    if(!ReadExactly(fd, header, 4))
+        return false;
+    size_t size = (size_t(header[0]) << 24) | (size_t(header[1]) << 16) |
+                  (size_t(header[2]) << 8) | size_t(header[3]);
+    if(size > max_size)
+        return false;
+    payload.resize(size);
+    return size == 0 || ReadExactly(fd, &payload[0], size);
+}
+
+bool WriteFrame(int fd, const std::vector<unsigned char>& payload) {
+    size_t size = payload.size();
+    unsigned char header[4] = {
+        (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+        (unsigned char)(size >> 8), (unsigned char)size };
+    if(!WriteAll(fd, header, 4))
+        return false;
+    return payload.empty() || WriteAll(fd, &payload[0], payload.size());
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+//Helpers to move encoded images over file descriptors (pipes, sockets).
+//
+//A frame is a 4 byte, big endian payload length followed by the payload.
+//An empty frame is valid and is used to signal a failed job without
+//losing synchronization of the stream.
+
+//Reads from fd until end of file. Returns false on a read error.
+bool ReadAll(int fd, std::vector<unsigned char>& bytes);
+
+//Writes size bytes to fd, retrying on partial writes and interrupts.
+//Returns false on a write error.
+bool WriteAll(int fd, const unsigned char* data, size_t size);
+
+//payloads larger than this are treated as a corrupt stream
+const size_t kMaxFrameSize = 1u << 30;
+
+//Reads the next frame from fd into payload. Returns false at the end of the
+//stream or on an error (including a stream that ends inside a frame or a
+//frame larger than max_size).
+bool ReadFrame(int fd, std::vector<unsigned char>& payload,
+               size_t max_size = kMaxFrameSize);
+
+//Writes payload to fd as a single frame. Returns false on a write error.
+bool WriteFrame(int fd, const std::vector<unsigned char>& payload);
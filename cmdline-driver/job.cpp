@@ -0,0 +1,330 @@
+#include "job.h"
+
+#include <chrono>
+#include <sstream>
+
+JobParams::JobParams()
+    : width(0), height(0), numcolors(0), max_iter(128), slic_factor(45),
+      saturation(1.1f), smooth_factor(0.1f), sigma_color(2.0f),
+      sigma_position(0.97f), use_alpha(false), deadline_ms(0),
+      schedule("geometric"), max_churn(0.001f), max_movement(0.05f),
+      stall_patience(3), error_window(8), window_tolerance(0.25f),
+      accelerate(false), binned_palette(false), sparse_colors(0),
+      seeding("split") {
+}
+
+std::string FormatParams(const JobParams& params) {
+    std::ostringstream text;
+    text << "width=" << params.width << "\n"
+         << "height=" << params.height << "\n"
+         << "numcolors=" << params.numcolors << "\n"
+         << "max_iter=" << params.max_iter << "\n"
+         << "slic_factor=" << params.slic_factor << "\n"
+         << "saturation=" << params.saturation << "\n"
+         << "smooth_factor=" << params.smooth_factor << "\n"
+         << "sigma_color=" << params.sigma_color << "\n"
+         << "sigma_position=" << params.sigma_position << "\n"
+         << "use_alpha=" << (params.use_alpha ? 1 : 0) << "\n"
+         << "deadline_ms=" << params.deadline_ms << "\n"
+         << "schedule=" << params.schedule << "\n"
+         << "max_churn=" << params.max_churn << "\n"
+         << "max_movement=" << params.max_movement << "\n"
+         << "stall_patience=" << params.stall_patience << "\n"
+         << "error_window=" << params.error_window << "\n"
+         << "window_tolerance=" << params.window_tolerance << "\n"
+         << "accelerate=" << (params.accelerate ? 1 : 0) << "\n"
+         << "binned_palette=" << (params.binned_palette ? 1 : 0) << "\n"
+         << "sparse_colors=" << params.sparse_colors << "\n"
+         << "seeding=" << params.seeding << "\n";
+    return text.str();
+}
+
+bool ParsePaletteSeeding(const std::string& name, PaletteSeeding& seeding) {
+    if(name == "split")
+        seeding = kSeedSplit;
+    else if(name == "kmeans++")
+        seeding = kSeedKMeansPlusPlus;
+    else if(name == "histogram")
+        seeding = kSeedHistogram;
+    else
+        return false;
+    return true;
+}
+
+bool ValidateParams(const JobParams& params, std::string& error) {
+    if(params.width == 0 && params.height == 0) {
+        error = "You cannot specify 0 for both width and height";
+        return false;
+    }
+    if(params.width < 0 || params.height < 0 || params.numcolors < 1) {
+        error = "Output size and number of colors have to be positive";
+        return false;
+    }
+    if(params.width > kMaxOutputSide || params.height > kMaxOutputSide) {
+        error = "The output size cannot exceed " + std::to_string(kMaxOutputSide) + " pixels";
+        return false;
+    }
+    if(params.max_iter > kMaxIterations) {
+        error = "The number of iterations cannot exceed " + std::to_string(kMaxIterations);
+        return false;
+    }
+    if(params.deadline_ms < 0) {
+        error = "The deadline cannot be negative";
+        return false;
+    }
+    if(params.sparse_colors < 0) {
+        error = "The number of sparse colors cannot be negative";
+        return false;
+    }
+    if(!ParseAnnealingSchedule(params.schedule)) {
+        error = "Unknown annealing schedule " + params.schedule +
+                ", use geometric, adaptive, critical or budget:<iterations>";
+        return false;
+    }
+    PaletteSeeding seeding;
+    if(!ParsePaletteSeeding(params.seeding, seeding)) {
+        error = "Unknown palette seeding " + params.seeding + ", use split, kmeans++ or histogram";
+        return false;
+    }
+    return true;
+}
+
+//Parses value into field. Returns false if value is not a valid T.
+template<typename T>
+static bool ParseValue(const std::string& value, T& field) {
+    std::istringstream stream(value);
+    T parsed;
+    if(!(stream >> parsed) || !(stream >> std::ws).eof())
+        return false;
+    field = parsed;
+    return true;
+}
+
+bool ParseParams(const std::string& text, JobParams& params,
+                 std::map<std::string, std::string>* extra, std::string& error) {
+    std::istringstream lines(text);
+    std::string line;
+    while(std::getline(lines, line)) {
+        if(!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if(line.empty() || line[0] == '#')
+            continue;
+        size_t equals = line.find('=');
+        if(equals == std::string::npos) {
+            error = "Expected key=value, got: " + line;
+            return false;
+        }
+        std::string key = line.substr(0, equals);
+        std::string value = line.substr(equals + 1);
+
+        bool valid;
+        if(key == "width") valid = ParseValue(value, params.width);
+        else if(key == "height") valid = ParseValue(value, params.height);
+        else if(key == "numcolors") valid = ParseValue(value, params.numcolors);
+        else if(key == "max_iter") valid = ParseValue(value, params.max_iter);
+        else if(key == "slic_factor") valid = ParseValue(value, params.slic_factor);
+        else if(key == "saturation") valid = ParseValue(value, params.saturation);
+        else if(key == "smooth_factor") valid = ParseValue(value, params.smooth_factor);
+        else if(key == "sigma_color") valid = ParseValue(value, params.sigma_color);
+        else if(key == "sigma_position") valid = ParseValue(value, params.sigma_position);
+        else if(key == "use_alpha") valid = ParseValue(value, params.use_alpha);
+        else if(key == "deadline_ms") valid = ParseValue(value, params.deadline_ms);
+        else if(key == "schedule") valid = ParseValue(value, params.schedule);
+        else if(key == "max_churn") valid = ParseValue(value, params.max_churn);
+        else if(key == "max_movement") valid = ParseValue(value, params.max_movement);
+        else if(key == "stall_patience") valid = ParseValue(value, params.stall_patience);
+        else if(key == "error_window") valid = ParseValue(value, params.error_window);
+        else if(key == "window_tolerance") valid = ParseValue(value, params.window_tolerance);
+        else if(key == "accelerate") valid = ParseValue(value, params.accelerate);
+        else if(key == "binned_palette") valid = ParseValue(value, params.binned_palette);
+        else if(key == "sparse_colors") valid = ParseValue(value, params.sparse_colors);
+        else if(key == "seeding") valid = ParseValue(value, params.seeding);
+        else if(extra) {
+            (*extra)[key] = value;
+            valid = true;
+        } else {
+            error = "Unknown parameter " + key;
+            return false;
+        }
+        if(!valid) {
+            error = "Invalid value for " + key + ": " + value;
+            return false;
+        }
+    }
+    return ValidateParams(params, error);
+}
+
+int DecodeFlags(const JobParams& params) {
+    //-1 loads the image as is (including alpha channel)
+    return params.use_alpha ? -1 : CV_LOAD_IMAGE_COLOR;
+}
+
+bool PrepareInput(const cv::Mat& decoded, const JobParams& params,
+                  cv::Mat& image, cv::Mat& weights, std::string& error) {
+    if(!decoded.data) {
+        error = "Could not open or find the image";
+        return false;
+    }
+    if(params.use_alpha && decoded.channels() != 4) {
+        error = "Trying to use alpha channel as importance map, but image has no alpha channel";
+        return false;
+    }
+    
+    cv::Mat color = decoded;
+    weights = cv::Mat();
+    if(decoded.channels() == 4) {
+        std::vector<cv::Mat> channels;
+        cv::split(decoded, channels);
+        if(params.use_alpha)
+            channels[3].convertTo(weights, CV_32FC1, 1/255.0);
+        channels.pop_back();
+        cv::merge(channels, color);
+    } else if(decoded.channels() != 3) {
+        error = "Only 3 and 4 channel images are supported";
+        return false;
+    }
+    
+    //Pix expects an image in CV_32FC3 format
+    color.convertTo(image, CV_32FC3, 1/255.0);
+    return true;
+}
+
+bool ResolveOutputSize(JobParams& params, int input_width, int input_height,
+                       std::string& error) {
+    //Invalid case of width == height == 0 is managed by the callers
+    if(params.width == 0)
+        params.width = params.height * (static_cast<double>(input_width) / input_height);
+    else if (params.height == 0)
+        params.height = params.width * (static_cast<double>(input_height) / input_width);
+    //a very wide or tall input rounds the other side down to nothing
+    if(params.width < 1 || params.height < 1) {
+        error = "The output size rounds to 0 pixels for this input, give both width and height";
+        return false;
+    }
+    if(params.width > kMaxOutputSide || params.height > kMaxOutputSide) {
+        error = "The output size cannot exceed " + std::to_string(kMaxOutputSide) + " pixels";
+        return false;
+    }
+    return true;
+}
+
+Pix* CreatePix(const cv::Mat& image, const cv::Mat& weights,
+               const JobParams& params) {
+    return CreatePix(PixInput::FromRgb(image, weights), params, ExecutorPtr());
+}
+
+Pix* CreatePix(const PixInputPtr& input, const JobParams& params,
+               const ExecutorPtr& executor, uint64 seed) {
+    Pix* pix = new Pix(input, params.width, params.height, params.numcolors);
+    pix->set_executor(executor);
+    pix->set_seed(seed);
+    pix->SetBilateralParams(params.sigma_color, params.sigma_position);
+    pix->set_laplacian_factor(params.smooth_factor);
+    pix->setSlicFact(params.slic_factor);
+    pix->SetSaturation(params.saturation);
+    pix->set_schedule(ParseAnnealingSchedule(params.schedule));
+    ConvergenceCriteria criteria;
+    criteria.max_churn = params.max_churn;
+    criteria.max_movement = params.max_movement;
+    criteria.patience = params.stall_patience;
+    criteria.error_window = params.error_window;
+    criteria.window_tolerance = params.window_tolerance;
+    pix->set_convergence_criteria(criteria);
+    pix->set_palette_acceleration(params.accelerate);
+    pix->set_binned_palette(params.binned_palette);
+    pix->set_sparse_association(params.sparse_colors);
+    PaletteSeeding seeding = kSeedSplit;
+    ParsePaletteSeeding(params.seeding, seeding);
+    pix->set_palette_seeding(seeding);
+    pix->Initialize();
+    return pix;
+}
+
+PixRunStatus RunPix(Pix& pix, const JobParams& params,
+                    std::chrono::steady_clock::time_point start,
+                    const PixProgressCallback& progress, const PixCancelToken* cancel) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    if(params.deadline_ms > 0)
+        deadline = start + std::chrono::milliseconds(params.deadline_ms);
+    return pix.RunUntil(deadline, params.max_iter, [&](const PixProgress& report) {
+        pix.SaveState();
+        if(progress)
+            progress(report);
+    }, cancel);
+}
+
+std::string StopReason(const Pix& pix, PixRunStatus status) {
+    switch(status) {
+    case kRunConverged: return PixConvergenceName(pix.convergence());
+    case kRunMaxIterations: return "max iterations";
+    case kRunDeadline: return "cut short by the deadline";
+    default: return "cancelled";
+    }
+}
+
+std::string CacheKey(const cv::Mat& decoded, const JobParams& params) {
+    JobParams keyed = params;
+    keyed.deadline_ms = 0;
+    ResultKey key;
+    key.Add(decoded);
+    key.Add(FormatParams(keyed));
+    return key.str();
+}
+
+JobResult ProcessImage(const cv::Mat& decoded, JobParams params,
+                       cv::Mat& output, ResultCache* cache,
+                       const ExecutorPtr& executor) {
+    JobResult result;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::string key;
+    PixResult pix_result;
+    if(cache && !decoded.empty()) {
+        key = CacheKey(decoded, params);
+        result.cached = cache->Lookup(key, pix_result);
+    }
+
+    cv::Mat image, weights;
+    if(result.cached) {
+        result.ok = true;
+    } else if(PrepareInput(decoded, params, image, weights, result.error) &&
+              ResolveOutputSize(params, image.cols, image.rows, result.error)) {
+        Pix* pix = CreatePix(PixInput::FromRgb(image, weights), params, executor);
+        PixRunStatus status = RunPix(*pix, params, start, PixProgressCallback(), NULL);
+        result.truncated = status == kRunDeadline;
+        result.stop_reason = StopReason(*pix, status);
+        pix->GetResult(pix_result);
+        delete pix;
+        //a result cut short depends on the timing of the run
+        if(cache && !result.truncated)
+            cache->Store(key, pix_result);
+        result.ok = true;
+    }
+    if(result.ok) {
+        result.iterations = pix_result.iterations;
+        PixOutputs outputs;
+        outputs.output = &output;
+        Pix::RenderResult(pix_result, outputs);
+    }
+
+    result.wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+JobResult ProcessFile(const std::string& inputfile,
+                      const std::string& outputfile, JobParams params,
+                      ResultCache* cache, const ExecutorPtr& executor) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    cv::Mat output;
+    JobResult result = ProcessImage(cv::imread(inputfile, DecodeFlags(params)),
+                                    params, output, cache, executor);
+    if(result.ok) {
+        result.ok = imwrite(outputfile, output);
+        if(!result.ok)
+            result.error = "Could not write " + outputfile;
+    }
+    result.wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+}
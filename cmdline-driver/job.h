@@ -0,0 +1,161 @@
+#pragma once
+
+#include "pix.h"
+#include "resultCache.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+
+//Algorithm parameters of a single job. The defaults match the defaults of
+//the command line driver.
+struct JobParams {
+    int width;
+    int height;
+    int numcolors;
+    int max_iter;
+    int slic_factor;
+    float saturation;
+    float smooth_factor;
+    float sigma_color;
+    float sigma_position;
+    bool use_alpha;
+    //time limit of the job in milliseconds, counted from its start. A run
+    //that would take longer is cut short with the best result so far (see
+    //Pix::RunUntil()). 0 runs to convergence.
+    int deadline_ms;
+    //annealing schedule, see ParseAnnealingSchedule()
+    std::string schedule;
+    //early convergence at the final temperature, see ConvergenceCriteria.
+    //Negative values disable a criterion.
+    float max_churn;
+    float max_movement;
+    int stall_patience;
+    int error_window;
+    float window_tolerance;
+    //over-relaxed palette refinement, see Pix::set_palette_acceleration()
+    bool accelerate;
+    //palette EM over L*a*b* bins of the superpixel colors, see
+    //Pix::set_binned_palette()
+    bool binned_palette;
+    //colors kept per superpixel by the sparse association, 0 keeps all,
+    //see Pix::set_sparse_association()
+    int sparse_colors;
+    //palette initialization: split, kmeans++ or histogram, see
+    //ParsePaletteSeeding()
+    std::string seeding;
+
+    JobParams();
+};
+
+//Largest output width or height and largest iteration limit of a job. The
+//daemon runs requests from other processes, so the limits keep a single
+//request from exhausting its memory or its workers.
+const int kMaxOutputSide = 4096;
+const int kMaxIterations = 100000;
+
+//Serializes params as "key=value" lines, one per field, using the field
+//names as keys.
+std::string FormatParams(const JobParams& params);
+
+//Parses the name of a palette seeding: "split" (kSeedSplit), "kmeans++"
+//(kSeedKMeansPlusPlus) or "histogram" (kSeedHistogram). Returns false for
+//other names.
+bool ParsePaletteSeeding(const std::string& name, PaletteSeeding& seeding);
+
+//Checks that params describe a valid job. Returns false and sets error
+//otherwise.
+bool ValidateParams(const JobParams& params, std::string& error);
+
+//Parses "key=value" lines as written by FormatParams into params. Fields
+//that are not mentioned keep their value. Keys that are not fields of
+//JobParams are stored in extra, or rejected if extra is NULL. Blank lines
+//and lines starting with # are ignored. Returns false and sets error on
+//malformed input or if the result does not pass ValidateParams.
+bool ParseParams(const std::string& text, JobParams& params,
+                 std::map<std::string, std::string>* extra, std::string& error);
+
+//Returns the cv::imread/cv::imdecode flags to decode an input image for
+//the given parameters. The alpha channel is only kept if it is used.
+int DecodeFlags(const JobParams& params);
+
+//Converts an image as returned by cv::imread/cv::imdecode (8U, 3 or 4
+//channels) into the CV_32FC3 format expected by Pix. If params.use_alpha is
+//set, the alpha channel is returned in weights (CV_32FC1, [0,1]), otherwise
+//weights is left empty. Returns false and sets error if the image cannot be
+//used with the given parameters.
+bool PrepareInput(const cv::Mat& decoded, const JobParams& params,
+                  cv::Mat& image, cv::Mat& weights, std::string& error);
+
+//Replaces a width or height of 0 by the value reproducing the aspect ratio
+//of an input image of the given size. Returns false and sets error if the
+//resolved size is 0 or larger than kMaxOutputSide.
+bool ResolveOutputSize(JobParams& params, int input_width, int input_height,
+                       std::string& error);
+
+//Creates and initializes a Pix object for a prepared input image. The
+//output size has to be resolved already. The caller owns the result.
+Pix* CreatePix(const cv::Mat& image, const cv::Mat& weights,
+               const JobParams& params);
+
+//Creates and initializes a Pix object attached to a shared input, which
+//is converted to L*a*b* only once however many instances use it.
+//params.use_alpha is ignored: the weights are those of input. The parallel
+//stages of the instance run on executor, or serially if it is NULL. seed
+//drives the random choices of the instance, see Pix::set_seed().
+Pix* CreatePix(const PixInputPtr& input, const JobParams& params,
+               const ExecutorPtr& executor, uint64 seed = kDefaultSeed);
+
+//Iterates until convergence, until params.max_iter iterations, until
+//params.deadline_ms after start or until cancel (if not NULL) is
+//cancelled, saving the state after every iteration. A run that reaches the
+//deadline finishes early with the best result so far. Calls progress (if
+//set) after every iteration. Returns how the run ended.
+PixRunStatus RunPix(Pix& pix, const JobParams& params,
+                    std::chrono::steady_clock::time_point start,
+                    const PixProgressCallback& progress, const PixCancelToken* cancel);
+
+//Describes how a run that ended with status stopped: the reason of its
+//convergence (see PixConvergenceName()), "max iterations", "cut short by
+//the deadline" or "cancelled"
+std::string StopReason(const Pix& pix, PixRunStatus status);
+
+//Outcome of processing a single image
+struct JobResult {
+    bool ok;
+    //true if the result was read from a ResultCache
+    bool cached;
+    //true if params.deadline_ms cut the run short; the output is the best
+    //result so far
+    bool truncated;
+    int iterations;
+    double wall_ms;
+    //see StopReason(), empty if the algorithm did not run
+    std::string stop_reason;
+    std::string error;
+
+    JobResult() : ok(false), cached(false), truncated(false), iterations(0), wall_ms(0) {}
+};
+
+//Returns the ResultCache key of a decoded image (as returned by cv::imread)
+//processed with params. Every field of params but deadline_ms is part of
+//the key: results cut short by a deadline are not stored, and a complete
+//run does not depend on it.
+std::string CacheKey(const cv::Mat& decoded, const JobParams& params);
+
+//Runs the algorithm on a decoded image (as returned by cv::imread) and
+//returns the output image in output. params is copied since the output
+//size is resolved per image. If cache is not NULL, a cached result is used
+//instead of running the algorithm, and new complete results are added to
+//it. params.deadline_ms counts from the call. The
+//parallel stages run on executor, or serially if it is NULL.
+JobResult ProcessImage(const cv::Mat& decoded, JobParams params,
+                       cv::Mat& output, ResultCache* cache,
+                       const ExecutorPtr& executor);
+
+//Reads the image inputfile, runs the algorithm and writes the output image
+//to outputfile. params is copied since the output size is resolved per
+//image. cache and executor are used as in ProcessImage.
+JobResult ProcessFile(const std::string& inputfile,
+                      const std::string& outputfile, JobParams params,
+                      ResultCache* cache, const ExecutorPtr& executor);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "job.h"
+
+#include <algorithm>
+
+#include <tclap/CmdLine.h>
+
+//The algorithm fine-tuning arguments shared by all modes of the driver.
+//See the argument descriptions for their meaning and defaults.
+class JobArgs {
+ public:
+    JobArgs()
+        : maxiter_arg("m", "max-iterations", "Maximum number of iterations", false, 128, "number iterations"),
+          slic_factor_arg("l", "slic-factor", "SLIC factor", false, 45, "integer value"),
+          saturation_arg("t", "saturation", "Saturation value", false, 1.1f, "floating point value"),
+          smooth_factor_arg("f", "smooth-factor", "Smooth factor", false, 0.1f, "floating point value"),
+          sigma_color_arg("c", "sigma", "Sigma value (color)", false, 2.0f, "floating point value"),
+          sigma_position_arg("p", "sigmap", "Sigma value (position)", false, 0.97f, "floating point value"),
+          use_alpha_arg("a","use-alpha","Use Alpha-Channel for Importance Sampling", false),
+          schedule_arg("", "schedule", "Annealing schedule: geometric cools by a constant factor once the palette settles, adaptive cools faster while the palette hardly moves, critical cools straight to just above the next expected split, budget:<iterations> reaches the final temperature in that many iterations", false, "geometric", "schedule"),
+          max_churn_arg("", "max-churn", "Converge at the final temperature once at most this fraction of the output pixels changes color per iteration (and --max-movement holds) for --stall-patience iterations. Negative disables", false, 0.001f, "fraction"),
+          max_movement_arg("", "max-movement", "Converge at the final temperature once the superpixels move by at most this many input pixels per iteration on average (and --max-churn holds) for --stall-patience iterations. Negative disables", false, 0.05f, "pixels"),
+          stall_patience_arg("", "stall-patience", "Iterations in a row that have to meet --max-churn and --max-movement", false, 3, "number iterations"),
+          error_window_arg("", "error-window", "Converge at the final temperature once the palette error varied by less than --window-tolerance over this many iterations. Negative disables", false, 8, "number iterations"),
+          window_tolerance_arg("", "window-tolerance", "See --error-window", false, 0.25f, "floating point value"),
+          accelerate_arg("", "accelerate", "Over-relax the palette refinement while it converges, which settles each temperature in fewer iterations", false),
+          binned_palette_arg("", "binned-palette", "Run the palette updates over bins of similar superpixel colors instead of every superpixel, which makes them much faster for large outputs at a small cost in accuracy", false),
+          sparse_colors_arg("", "sparse-colors", "Keep only this many of the most probable palette colors per superpixel, which bounds the memory and time of the palette updates for large palettes and outputs. 0 keeps all", false, 0, "number colors"),
+          seeding_arg("", "seeding", "Palette initialization: split grows the palette from the mean color by splitting (best quality), kmeans++ and histogram seed a full palette from the superpixel colors, which skips the splitting for faster runs", false, "split", "seeding"),
+          deadline_arg("", "deadline", "Time limit per image. When it is about to run out, the palette is condensed and the best result so far is used. 0 runs to convergence", false, 0, "milliseconds") {
+    }
+
+    void AddTo(TCLAP::CmdLine& cmd) {
+        cmd.add(use_alpha_arg);
+        cmd.add(maxiter_arg);
+        cmd.add(slic_factor_arg);
+        cmd.add(saturation_arg);
+        cmd.add(smooth_factor_arg);
+        cmd.add(sigma_color_arg);
+        cmd.add(sigma_position_arg);
+        cmd.add(schedule_arg);
+        cmd.add(max_churn_arg);
+        cmd.add(max_movement_arg);
+        cmd.add(stall_patience_arg);
+        cmd.add(error_window_arg);
+        cmd.add(window_tolerance_arg);
+        cmd.add(accelerate_arg);
+        cmd.add(binned_palette_arg);
+        cmd.add(sparse_colors_arg);
+        cmd.add(seeding_arg);
+        cmd.add(deadline_arg);
+    }
+
+    //copies the parsed values into params. Throws a TCLAP::ArgException
+    //for an unknown schedule or seeding.
+    void Get(JobParams& params) {
+        params.use_alpha = use_alpha_arg.getValue();
+        params.max_iter = maxiter_arg.getValue();
+        params.slic_factor = slic_factor_arg.getValue();
+        params.saturation = saturation_arg.getValue();
+        params.smooth_factor = smooth_factor_arg.getValue();
+        params.sigma_color = sigma_color_arg.getValue();
+        params.sigma_position = sigma_position_arg.getValue();
+        params.schedule = schedule_arg.getValue();
+        if(!ParseAnnealingSchedule(params.schedule))
+            throw TCLAP::CmdLineParseException("Unknown annealing schedule " + params.schedule,
+                                               schedule_arg.toString());
+        params.max_churn = max_churn_arg.getValue();
+        params.max_movement = max_movement_arg.getValue();
+        params.stall_patience = stall_patience_arg.getValue();
+        params.error_window = error_window_arg.getValue();
+        params.window_tolerance = window_tolerance_arg.getValue();
+        params.accelerate = accelerate_arg.getValue();
+        params.binned_palette = binned_palette_arg.getValue();
+        params.sparse_colors = std::max(0, sparse_colors_arg.getValue());
+        params.seeding = seeding_arg.getValue();
+        PaletteSeeding seeding;
+        if(!ParsePaletteSeeding(params.seeding, seeding))
+            throw TCLAP::CmdLineParseException("Unknown palette seeding " + params.seeding,
+                                               seeding_arg.toString());
+        params.deadline_ms = std::max(0, deadline_arg.getValue());
+    }
+
+ private:
+    TCLAP::ValueArg<int> maxiter_arg;
+    TCLAP::ValueArg<int> slic_factor_arg;
+    TCLAP::ValueArg<float> saturation_arg;
+    TCLAP::ValueArg<float> smooth_factor_arg;
+    TCLAP::ValueArg<float> sigma_color_arg;
+    TCLAP::ValueArg<float> sigma_position_arg;
+    TCLAP::SwitchArg use_alpha_arg;
+    TCLAP::ValueArg<std::string> schedule_arg;
+    TCLAP::ValueArg<float> max_churn_arg;
+    TCLAP::ValueArg<float> max_movement_arg;
+    TCLAP::ValueArg<int> stall_patience_arg;
+    TCLAP::ValueArg<int> error_window_arg;
+    TCLAP::ValueArg<float> window_tolerance_arg;
+    TCLAP::SwitchArg accelerate_arg;
+    TCLAP::SwitchArg binned_palette_arg;
+    TCLAP::ValueArg<int> sparse_colors_arg;
+    TCLAP::ValueArg<std::string> seeding_arg;
+    TCLAP::ValueArg<int> deadline_arg;
+};
+
+//The result cache arguments shared by the modes of the driver that process
+//images
+class CacheArgs {
+ public:
+    CacheArgs()
+        : cache_arg("", "cache", "Directory of an on-disk result cache. Images processed before with the same parameters are read from it instead of being computed again", false, "", "directory"),
+          cache_size_arg("", "cache-size", "Maximum size of the result cache, least recently used results are removed first", false, 1024, "megabytes") {
+    }
+
+    void AddTo(TCLAP::CmdLine& cmd) {
+        cmd.add(cache_arg);
+        cmd.add(cache_size_arg);
+    }
+
+    //returns the cache selected on the command line, or NULL if --cache was
+    //not given. The caller owns the result.
+    ResultCache* Create() {
+        if(cache_arg.getValue().empty())
+            return NULL;
+        return new ResultCache(cache_arg.getValue(),
+                               (size_t)std::max(0, cache_size_arg.getValue()) << 20);
+    }
+
+ private:
+    TCLAP::ValueArg<std::string> cache_arg;
+    TCLAP::ValueArg<int> cache_size_arg;
+};
@@ -0,0 +1,43 @@
+#include "manifest.h"
+#include "resultCache.h"
+
+#include <sstream>
+
+bool Manifest::Open(const std::string& path, const std::string& settings) {
+    ResultKey key;
+    key.Add(settings);
+    settings_key_ = key.str();
+
+    //lines of other settings, and those written before the settings were
+    //recorded, do not count
+    completed_.clear();
+    std::ifstream existing(path.c_str());
+    std::string line;
+    while(std::getline(existing, line)) {
+        std::istringstream fields(line);
+        std::string status, iterations, wall_ms, inputfile, message, settings_key;
+        if(std::getline(fields, status, '\t') &&
+           std::getline(fields, iterations, '\t') &&
+           std::getline(fields, wall_ms, '\t') &&
+           std::getline(fields, inputfile, '\t') &&
+           std::getline(fields, message, '\t') &&
+           std::getline(fields, settings_key, '\t') &&
+           status == "ok" && settings_key == settings_key_)
+            completed_.insert(inputfile);
+    }
+    existing.close();
+
+    file_.open(path.c_str(), std::ios::out | std::ios::app);
+    return file_.is_open();
+}
+
+bool Manifest::IsCompleted(const std::string& inputfile) const {
+    return completed_.count(inputfile) > 0;
+}
+
+void Manifest::Record(const std::string& inputfile, const JobResult& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_ << (result.ok ? "ok" : "failed") << '\t' << result.iterations << '\t'
+          << (long)(result.wall_ms + 0.5) << '\t' << inputfile << '\t'
+          << result.error << '\t' << settings_key_ << std::endl;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "job.h"
+
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+
+//A tab separated log of processed images, one line per image:
+//
+//    status <TAB> iterations <TAB> wall time [ms] <TAB> input <TAB> message
+//    <TAB> settings
+//
+//status is "ok" or "failed", settings is a hash of the settings of the run
+//(see Open()). The file is only ever appended to, so an interrupted run 
+//leaves a valid manifest behind and a rerun with the same settings can 
+//skip every image that already has an "ok" line for them.
+class Manifest {
+ public:
+    //Opens the manifest at path for appending and loads the images already
+    //completed by earlier runs with the same settings: everything that 
+    //affects the outputs, e.g. FormatParams() and the output format. 
+    //Returns false if it cannot be opened.
+    bool Open(const std::string& path, const std::string& settings);
+
+    //returns true if an earlier run with the same settings completed the 
+    //given input
+    bool IsCompleted(const std::string& inputfile) const;
+
+    //Appends the result for an input and flushes it to disk. Can be called
+    //from several threads.
+    void Record(const std::string& inputfile, const JobResult& result);
+
+ private:
+    std::set<std::string> completed_;
+    //hash of the settings passed to Open()
+    std::string settings_key_;
+    std::ofstream file_;
+    std::mutex mutex_;
+};
@@ -0,0 +1,252 @@
+#include "pipeline.h"
+#include "boundedqueue.h"
+#include "manifest.h"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+typedef std::chrono::steady_clock Clock;
+
+static double ElapsedMs(Clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+//An image in flight between the stages
+struct PipelineItem {
+    const PipelineJob* job;
+    JobParams params;
+    Pix* pix;
+    std::string cache_key;
+    //set once the result is known, either computed or read from the cache
+    PixResult pix_result;
+    JobResult result;
+    Clock::time_point start;
+};
+
+typedef BoundedQueue<PipelineItem*> ItemQueue;
+
+//Waits with increasing pauses: spin briefly, then yield, then sleep, so an
+//idle or throttled stage does not burn a core.
+class Backoff {
+ public:
+    Backoff() : count_(0) {}
+    void Wait() {
+        if(count_ < 16) {
+        } else if(count_ < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        count_++;
+    }
+ private:
+    int count_;
+};
+
+//Per thread counters, merged into the stage statistics when a thread ends
+struct StageCounters {
+    long items;
+    double busy_ms, starved_ms, blocked_ms;
+    StageCounters() : items(0), busy_ms(0), starved_ms(0), blocked_ms(0) {}
+};
+
+//A stage of the pipeline: counts the producers still feeding its output
+//queue and collects its statistics.
+struct Stage {
+    StageStats stats;
+    std::atomic<int> running;
+    std::mutex mutex;
+
+    void Merge(const StageCounters& counters) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.items += counters.items;
+        stats.busy_ms += counters.busy_ms;
+        stats.starved_ms += counters.starved_ms;
+        stats.blocked_ms += counters.blocked_ms;
+    }
+};
+
+//Pushes item, waiting while the queue is full
+static void Push(ItemQueue& queue, PipelineItem* item, StageCounters& counters) {
+    if(queue.TryPush(item))
+        return;
+    Clock::time_point start = Clock::now();
+    Backoff backoff;
+    while(!queue.TryPush(item)) {
+        backoff.Wait();
+    }
+    counters.blocked_ms += ElapsedMs(start);
+}
+
+//Pops the next item, waiting while the queue is empty. Returns false once
+//the queue is empty and the upstream stage has finished.
+static bool Pop(ItemQueue& queue, Stage& upstream, PipelineItem*& item,
+                StageCounters& counters) {
+    if(queue.TryPop(item))
+        return true;
+    Clock::time_point start = Clock::now();
+    Backoff backoff;
+    bool found = false;
+    while(!found) {
+        if(queue.TryPop(item)) {
+            found = true;
+        } else if(upstream.running.load() == 0) {
+            //upstream may have pushed right before it finished
+            found = queue.TryPop(item);
+            break;
+        } else {
+            backoff.Wait();
+        }
+    }
+    counters.starved_ms += ElapsedMs(start);
+    return found;
+}
+
+std::vector<StageStats> RunPipeline(const std::vector<PipelineJob>& jobs,
+                                    const JobParams& params,
+                                    const PipelineOptions& options,
+                                    Manifest& manifest,
+                                    ResultCache* cache,
+                                    const JobCallback& on_done) {
+    ItemQueue decoded(options.queue_capacity);
+    ItemQueue computed(options.queue_capacity);
+    Stage stages[3];
+    stages[0].stats.name = "decode";
+    stages[0].stats.threads = options.decoders;
+    stages[1].stats.name = "compute";
+    stages[1].stats.threads = options.workers;
+    stages[2].stats.name = "encode";
+    stages[2].stats.threads = options.encoders;
+    for(int i = 0; i < 3; ++i) {
+        stages[i].running = stages[i].stats.threads;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+
+    //decode: read the file and, unless it is cached, construct Pix, which
+    //converts to L*a*b*
+    for(int i = 0; i < options.decoders; ++i) {
+        threads.push_back(std::thread([&]() {
+            StageCounters counters;
+            for(size_t n = next++; n < jobs.size(); n = next++) {
+                Clock::time_point start = Clock::now();
+                PipelineItem* item = new PipelineItem();
+                item->job = &jobs[n];
+                item->params = params;
+                item->pix = NULL;
+                item->start = start;
+
+                cv::Mat input = cv::imread(item->job->inputfile, DecodeFlags(params));
+                if(cache && !input.empty()) {
+                    item->cache_key = CacheKey(input, params);
+                    item->result.cached = cache->Lookup(item->cache_key, item->pix_result);
+                }
+                cv::Mat image, weights;
+                if(!item->result.cached &&
+                   PrepareInput(input, item->params, image, weights, item->result.error) &&
+                   ResolveOutputSize(item->params, image.cols, image.rows,
+                                     item->result.error)) {
+                    item->pix = CreatePix(image, weights, item->params);
+                }
+                counters.items++;
+                counters.busy_ms += ElapsedMs(start);
+                Push(decoded, item, counters);
+            }
+            stages[0].Merge(counters);
+            stages[0].running--;
+        }));
+    }
+
+    //compute: iterate to convergence and add the result to the cache
+    for(int i = 0; i < options.workers; ++i) {
+        threads.push_back(std::thread([&]() {
+            StageCounters counters;
+            PipelineItem* item;
+            while(Pop(decoded, stages[0], item, counters)) {
+                Clock::time_point start = Clock::now();
+                if(item->pix) {
+                    //the deadline covers the computation, not the wait in
+                    //the queues
+                    PixRunStatus status = RunPix(*item->pix, item->params, start,
+                                                 PixProgressCallback(), NULL);
+                    item->result.truncated = status == kRunDeadline;
+                    item->result.stop_reason = StopReason(*item->pix, status);
+                    item->pix->GetResult(item->pix_result);
+                    delete item->pix;
+                    item->pix = NULL;
+                    if(cache && !item->result.truncated)
+                        cache->Store(item->cache_key, item->pix_result);
+                }
+                counters.items++;
+                counters.busy_ms += ElapsedMs(start);
+                Push(computed, item, counters);
+            }
+            stages[1].Merge(counters);
+            stages[1].running--;
+        }));
+    }
+
+    //encode: render, write and record the result
+    for(int i = 0; i < options.encoders; ++i) {
+        threads.push_back(std::thread([&]() {
+            StageCounters counters;
+            PipelineItem* item;
+            while(Pop(computed, stages[1], item, counters)) {
+                Clock::time_point start = Clock::now();
+                if(!item->pix_result.palette_assign.empty()) {
+                    cv::Mat output;
+                    PixOutputs outputs;
+                    outputs.output = &output;
+                    Pix::RenderResult(item->pix_result, outputs);
+                    item->result.iterations = item->pix_result.iterations;
+                    item->result.ok = imwrite(item->job->outputfile, output);
+                    if(!item->result.ok)
+                        item->result.error = "Could not write " + item->job->outputfile;
+                }
+                item->result.wall_ms = ElapsedMs(item->start);
+                manifest.Record(item->job->inputfile, item->result);
+                if(on_done)
+                    on_done(*item->job, item->result);
+                delete item;
+                counters.items++;
+                counters.busy_ms += ElapsedMs(start);
+            }
+            stages[2].Merge(counters);
+            stages[2].running--;
+        }));
+    }
+
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    std::vector<StageStats> stats;
+    for(int i = 0; i < 3; ++i) {
+        stats.push_back(stages[i].stats);
+    }
+    return stats;
+}
+
+void PrintStageStats(std::ostream& out, const std::vector<StageStats>& stats,
+                     double wall_ms) {
+    out << "stage    threads  images   busy  starved  blocked" << std::endl;
+    for(size_t i = 0; i < stats.size(); ++i) {
+        //fraction of the stage's thread time spent in each state
+        double total = stats[i].threads * wall_ms;
+        if(total <= 0)
+            total = 1;
+        out << std::left << std::setw(9) << stats[i].name << std::right
+            << std::setw(7) << stats[i].threads
+            << std::setw(8) << stats[i].items
+            << std::fixed << std::setprecision(1)
+            << std::setw(6) << 100.0 * stats[i].busy_ms / total << "%"
+            << std::setw(8) << 100.0 * stats[i].starved_ms / total << "%"
+            << std::setw(8) << 100.0 * stats[i].blocked_ms / total << "%"
+            << std::endl;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "job.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class Manifest;
+
+//Thread counts and queue sizes of the three pipeline stages
+struct PipelineOptions {
+    int decoders;
+    int workers;
+    int encoders;
+    //capacity of each of the two queues between the stages. Together with
+    //the thread counts it bounds the number of images in memory.
+    int queue_capacity;
+
+    PipelineOptions() : decoders(1), workers(1), encoders(1), queue_capacity(4) {}
+};
+
+//An image to process
+struct PipelineJob {
+    std::string inputfile;
+    std::string outputfile;
+};
+
+//How a stage spent its time, summed over its threads
+struct StageStats {
+    std::string name;
+    int threads;
+    long items;
+    //time spent processing images
+    double busy_ms;
+    //time spent waiting for an image from the previous stage
+    double starved_ms;
+    //time spent waiting for room in the queue to the next stage
+    double blocked_ms;
+
+    StageStats() : threads(0), items(0), busy_ms(0), starved_ms(0), blocked_ms(0) {}
+};
+
+//Called by the encode stage for every finished job, from several threads
+typedef std::function<void(const PipelineJob&, const JobResult&)> JobCallback;
+
+//Runs jobs through a three stage pipeline:
+//  1. decode the image and convert it to L*a*b* (construct Pix),
+//  2. iterate Pix to convergence,
+//  3. render and encode the output image,
+//connected by bounded lock-free queues. A stage that cannot hand an image
+//on waits until the next stage catches up, so slow stages throttle the fast
+//ones instead of letting decoded images pile up. Every job is recorded in
+//manifest and reported to on_done (which may be empty). If cache is not
+//NULL, the decode stage looks every image up in it and cached images skip
+//the compute stage. Returns the statistics of the decode, compute and
+//encode stages in that order.
+std::vector<StageStats> RunPipeline(const std::vector<PipelineJob>& jobs,
+                                    const JobParams& params,
+                                    const PipelineOptions& options,
+                                    Manifest& manifest,
+                                    ResultCache* cache,
+                                    const JobCallback& on_done);
+
+//Prints the per stage occupancy of a pipeline run that took wall_ms
+void PrintStageStats(std::ostream& out, const std::vector<StageStats>& stats,
+                     double wall_ms);
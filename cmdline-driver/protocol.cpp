@@ -0,0 +1,168 @@
+#include "protocol.h"
+#include "framing.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//A request header is a few dozen short "key=value" lines
+static const size_t kMaxHeaderSize = 16u << 10;
+//largest encoded input image a client may send
+static const size_t kMaxImageSize = 64u << 20;
+
+static std::vector<unsigned char> ToBytes(const std::string& text) {
+    return std::vector<unsigned char>(text.begin(), text.end());
+}
+
+static std::string ToText(const std::vector<unsigned char>& bytes) {
+    return std::string(bytes.begin(), bytes.end());
+}
+
+//Fills addr for socket_path. Returns false if the path is too long.
+static bool MakeAddress(const std::string& socket_path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(addr.sun_path))
+        return false;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+std::string DefaultSocketPath() {
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if(runtime_dir && *runtime_dir)
+        return std::string(runtime_dir) + "/pix.sock";
+    return "/tmp/pix.sock";
+}
+
+int ListenUnix(const std::string& socket_path, int backlog) {
+    sockaddr_un addr;
+    if(!MakeAddress(socket_path, addr)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path.c_str());
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    //only replace a leftover socket, never a regular file or a live daemon
+    struct stat info;
+    if(lstat(socket_path.c_str(), &info) == 0) {
+        if(!S_ISSOCK(info.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path.c_str());
+            close(fd);
+            return -1;
+        }
+        int live = ConnectUnix(socket_path);
+        if(live >= 0) {
+            close(live);
+            fprintf(stderr, "%s: daemon already running\n", socket_path.c_str());
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path.c_str());
+    }
+    //create the socket as 0600: requests may name files for the daemon to
+    //read, so only its own user may connect
+    mode_t old_mask = umask(0177);
+    int bound = bind(fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if(bound != 0 || listen(fd, backlog) != 0) {
+        perror(socket_path.c_str());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ConnectUnix(const std::string& socket_path) {
+    sockaddr_un addr;
+    if(!MakeAddress(socket_path, addr))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool SendRequest(int fd, const DaemonRequest& request) {
+    std::string header = FormatParams(request.params);
+    if(!request.path.empty())
+        header += "path=" + request.path + "\n";
+    header += "format=" + request.format + "\n";
+    return WriteFrame(fd, ToBytes(header)) && WriteFrame(fd, request.image);
+}
+
+bool ReadRequest(int fd, DaemonRequest& request, std::string& error) {
+    std::vector<unsigned char> header;
+    if(!ReadFrame(fd, header, kMaxHeaderSize) || !ReadFrame(fd, request.image, kMaxImageSize))
+        return false;
+
+    std::map<std::string, std::string> extra;
+    request.params = JobParams();
+    request.path.clear();
+    request.format = ".png";
+    error.clear();
+    if(!ParseParams(ToText(header), request.params, &extra, error))
+        return true;
+    for(std::map<std::string, std::string>::iterator it = extra.begin();
+        it != extra.end(); ++it) {
+        if(it->first == "path")
+            request.path = it->second;
+        else if(it->first == "format")
+            request.format = it->second;
+        else
+            error = "Unknown parameter " + it->first;
+    }
+    if(error.empty() && request.path.empty() && request.image.empty())
+        error = "Request has neither a path nor image data";
+    return true;
+}
+
+bool SendResponse(int fd, const DaemonResponse& response) {
+    std::ostringstream header;
+    header << "status=" << response.status << "\n"
+           << "iterations=" << response.iterations << "\n"
+           << "wall_ms=" << response.wall_ms << "\n"
+           << "truncated=" << (response.truncated ? 1 : 0) << "\n"
+           << "message=" << response.message << "\n";
+    return WriteFrame(fd, ToBytes(header.str())) && WriteFrame(fd, response.image);
+}
+
+bool ReadResponse(int fd, DaemonResponse& response) {
+    std::vector<unsigned char> header;
+    if(!ReadFrame(fd, header) || !ReadFrame(fd, response.image))
+        return false;
+    std::istringstream lines(ToText(header));
+    std::string line;
+    while(std::getline(lines, line)) {
+        size_t equals = line.find('=');
+        if(equals == std::string::npos)
+            continue;
+        std::string key = line.substr(0, equals);
+        std::string value = line.substr(equals + 1);
+        if(key == "status")
+            response.status = value;
+        else if(key == "iterations")
+            response.iterations = atoi(value.c_str());
+        else if(key == "wall_ms")
+            response.wall_ms = atof(value.c_str());
+        else if(key == "truncated")
+            response.truncated = atoi(value.c_str()) != 0;
+        else if(key == "message")
+            response.message = value;
+    }
+    return true;
+}
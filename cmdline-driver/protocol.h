@@ -0,0 +1,67 @@
+#pragma once
+
+#include "job.h"
+
+#include <string>
+#include <vector>
+
+//Protocol between the daemon (pix daemon) and its clients over a Unix
+//domain socket. A connection carries any number of request/response
+//exchanges, one at a time, each made of two frames (see framing.h):
+//
+//Request:  "key=value" lines with the JobParams fields (see FormatParams)
+//          plus the optional keys "path" (an image file the daemon reads
+//          itself) and "format" (output extension, default .png), then the
+//          encoded input image, empty if path is given.
+//Response: "key=value" lines with "status" (ok, error or busy),
+//          "iterations", "wall_ms", "truncated" and "message", then the
+//          encoded output image, empty unless status is ok. busy means the
+//          daemon's queue was full and the request was not run. truncated
+//          is 1 if the request's deadline_ms cut the run short and the
+//          image is the best result so far. deadline_ms counts from the
+//          arrival of the request.
+
+struct DaemonRequest {
+    JobParams params;
+    std::string path;
+    std::string format;
+    std::vector<unsigned char> image;
+
+    DaemonRequest() : format(".png") {}
+};
+
+struct DaemonResponse {
+    std::string status;
+    int iterations;
+    double wall_ms;
+    bool truncated;
+    std::string message;
+    std::vector<unsigned char> image;
+
+    DaemonResponse() : iterations(0), wall_ms(0), truncated(false) {}
+};
+
+//Returns the socket path used when none is given: pix.sock in
+//$XDG_RUNTIME_DIR, or /tmp/pix.sock if it is not set.
+std::string DefaultSocketPath();
+
+//Creates a socket listening on socket_path, replacing a stale socket file.
+//Refuses to replace a path that is not a socket, or a socket another daemon
+//still accepts connections on. The socket is only accessible to the user
+//running the daemon. Returns -1 and prints the reason on error.
+int ListenUnix(const std::string& socket_path, int backlog);
+
+//Connects to the daemon listening on socket_path. Returns -1 on error.
+int ConnectUnix(const std::string& socket_path);
+
+bool SendRequest(int fd, const DaemonRequest& request);
+
+//Reads the next request. Returns false at the end of the connection or if
+//the header or the image is larger than the protocol allows (16 KiB and
+//64 MiB). A request that arrives but cannot be parsed returns true with
+//error set.
+bool ReadRequest(int fd, DaemonRequest& request, std::string& error);
+
+bool SendResponse(int fd, const DaemonResponse& response);
+
+bool ReadResponse(int fd, DaemonResponse& response);
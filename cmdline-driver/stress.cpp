@@ -0,0 +1,167 @@
+#include "commands.h"
+#include "job.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tclap/CmdLine.h>
+
+//A combination of the algorithm's options exercised by the stress test
+struct StressMode {
+    const char* name;
+    int sparse_colors;
+    bool binned_palette;
+    const char* seeding;
+};
+
+static const StressMode kStressModes[] = {
+    {"split", 0, false, "split"},
+    {"sparse", 4, false, "split"},
+    {"binned", 0, true, "split"},
+    {"kmeans++", 0, false, "kmeans++"},
+    {"histogram", 0, false, "histogram"},
+    {"sparse+binned", 4, true, "kmeans++"},
+};
+static const int kStressModeCount = sizeof(kStressModes)/sizeof(kStressModes[0]);
+
+//One instance of the test: its options, executor, seed and results
+struct StressRun {
+    JobParams params;
+    const StressMode* mode;
+    bool pool;
+    uint64 seed;
+    PixResult serial;
+    PixResult concurrent;
+};
+
+//Returns a smooth random test image of size x size pixels, so the test
+//needs no input file
+static cv::Mat SyntheticImage(int size) {
+    cv::Mat image(size, size, CV_8UC3);
+    cv::RNG rng(kDefaultSeed);
+    rng.fill(image, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::GaussianBlur(image, image, cv::Size(0, 0), size / 16.0);
+    cv::normalize(image, image, 0, 255, cv::NORM_MINMAX);
+    return image;
+}
+
+static void RunInstance(const PixInputPtr& input, const StressRun& run,
+                        const ExecutorPtr& executor, PixResult& result) {
+    Pix* pix = CreatePix(input, run.params, executor, run.seed);
+    RunPix(*pix, run.params, std::chrono::steady_clock::now(), PixProgressCallback(), NULL);
+    pix->GetResult(result);
+    delete pix;
+}
+
+static bool SameResult(const PixResult& a, const PixResult& b) {
+    return a.iterations == b.iterations && a.palette == b.palette &&
+           a.palette_assign.size() == b.palette_assign.size() &&
+           cv::countNonZero(a.palette_assign != b.palette_assign) == 0;
+}
+
+int StressMain(int argc, char* argv[]) {
+    std::string inputfile;
+    int instances;
+    int jobs;
+    int pool_threads;
+    JobParams base;
+
+    try {
+        TCLAP::CmdLine cmd("Runs many instances concurrently on one shared input, on the serial and the thread pool executors and in the sparse, binned and seeded modes, and checks that each result matches a serial run with the same seed. Meant for the ThreadSanitizer build (make tsan).", ' ', "1.0");
+        TCLAP::UnlabeledValueArg<std::string> input_arg("in", "input filename, a synthetic image is used if none is given", false, "", "input filename");
+        TCLAP::ValueArg<int> instances_arg("n", "instances", "Number of instances", false, 2 * kStressModeCount, "number instances");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of instances run concurrently", false, 4, "number jobs");
+        TCLAP::ValueArg<int> pool_arg("", "pool-threads", "Threads of the pool shared by the instances on the thread pool executor", false, 2, "number threads");
+        TCLAP::ValueArg<int> width_arg("", "width", "Output width", false, 24, "width");
+        TCLAP::ValueArg<int> numcolors_arg("", "numcolors", "Output number of colors", false, 8, "number colors");
+        TCLAP::ValueArg<int> maxiter_arg("m", "max-iterations", "Maximum number of iterations", false, 32, "number iterations");
+        cmd.add(input_arg);
+        cmd.add(instances_arg);
+        cmd.add(jobs_arg);
+        cmd.add(pool_arg);
+        cmd.add(width_arg);
+        cmd.add(numcolors_arg);
+        cmd.add(maxiter_arg);
+
+        cmd.parse( argc, argv );
+
+        inputfile = input_arg.getValue();
+        instances = std::max(1, instances_arg.getValue());
+        jobs = std::max(1, jobs_arg.getValue());
+        pool_threads = std::max(1, pool_arg.getValue());
+        base.width = width_arg.getValue();
+        base.numcolors = numcolors_arg.getValue();
+        base.max_iter = maxiter_arg.getValue();
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    cv::Mat decoded = inputfile.empty() ? SyntheticImage(128)
+        : cv::imread(inputfile, DecodeFlags(base));
+    cv::Mat image, weights;
+    std::string error;
+    if(!ValidateParams(base, error) ||
+       !PrepareInput(decoded, base, image, weights, error) ||
+       !ResolveOutputSize(base, image.cols, image.rows, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    //every instance attaches to the same read-only input
+    PixInputPtr input = PixInput::FromRgb(image, weights);
+
+    //cycle through the modes, then switch executors, so a few instances
+    //already cover every combination
+    std::vector<StressRun> runs(instances);
+    for(int i = 0; i < instances; ++i) {
+        StressRun& run = runs[i];
+        run.mode = &kStressModes[i % kStressModeCount];
+        run.pool = (i / kStressModeCount) % 2 == 1;
+        run.seed = kDefaultSeed + i;
+        run.params = base;
+        run.params.sparse_colors = run.mode->sparse_colors;
+        run.params.binned_palette = run.mode->binned_palette;
+        run.params.seeding = run.mode->seeding;
+    }
+
+    //the expected results, one instance at a time
+    for(int i = 0; i < instances; ++i) {
+        RunInstance(input, runs[i], ExecutorPtr(), runs[i].serial);
+    }
+
+    //the same instances, jobs at a time, the pooled ones sharing one pool
+    ExecutorPtr pool(new ThreadPoolExecutor(pool_threads));
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for(int j = 0; j < jobs; ++j) {
+        workers.push_back(std::thread([&]() {
+            for(int i = next++; i < instances; i = next++) {
+                RunInstance(input, runs[i], runs[i].pool ? pool : ExecutorPtr(),
+                            runs[i].concurrent);
+            }
+        }));
+    }
+    for(size_t j = 0; j < workers.size(); ++j) {
+        workers[j].join();
+    }
+
+    int failures = 0;
+    for(int i = 0; i < instances; ++i) {
+        if(!SameResult(runs[i].serial, runs[i].concurrent)) {
+            std::cerr << "instance " << i << " (" << runs[i].mode->name << ", "
+                      << (runs[i].pool ? "pool" : "serial") << " executor)"
+                      << " differs from its serial run" << std::endl;
+            failures++;
+        }
+    }
+    std::cerr << instances << " instances on " << jobs << " threads, "
+              << failures << " mismatches" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
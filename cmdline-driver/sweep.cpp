@@ -0,0 +1,303 @@
+#include "commands.h"
+#include "job.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <tclap/CmdLine.h>
+
+//Parses text as a single T. Returns false if it is not a valid T.
+template<typename T>
+static bool ParseValue(const std::string& text, T& value) {
+    std::istringstream stream(text);
+    return (stream >> value) && (stream >> std::ws).eof();
+}
+
+//Parses a list of values: comma separated values and ranges of the form
+//first:last[:step] (step defaults to 1), e.g. "16,24:48:8" is 16 24 32 40 48.
+//Returns false and sets error on malformed input.
+template<typename T>
+static bool ParseValues(const std::string& name, const std::string& text,
+                        std::vector<T>& values, std::string& error) {
+    values.clear();
+    std::istringstream items(text);
+    std::string item;
+    while(std::getline(items, item, ',')) {
+        std::vector<std::string> fields;
+        std::istringstream range(item);
+        std::string field;
+        while(std::getline(range, field, ':')) {
+            fields.push_back(field);
+        }
+        T first, last, step = 1;
+        bool valid = !fields.empty() && fields.size() <= 3 &&
+                     ParseValue(fields[0], first);
+        last = first;
+        if(valid && fields.size() > 1)
+            valid = ParseValue(fields[1], last);
+        if(valid && fields.size() > 2)
+            valid = ParseValue(fields[2], step);
+        if(!valid || step <= 0 || last < first) {
+            error = "Invalid value list for " + name + ": " + text;
+            return false;
+        }
+        //the tolerance keeps float ranges from losing their last value
+        for(int i = 0; first + i * step <= last + step * 1e-3; ++i) {
+            values.push_back(first + i * step);
+        }
+    }
+    if(values.empty()) {
+        error = "No values given for " + name;
+        return false;
+    }
+    return true;
+}
+
+//Splits a comma separated list of names. Returns false and sets error if
+//the list is empty.
+static bool ParseNames(const std::string& name, const std::string& text,
+                       std::vector<std::string>& values, std::string& error) {
+    values.clear();
+    std::istringstream items(text);
+    std::string item;
+    while(std::getline(items, item, ',')) {
+        if(!item.empty())
+            values.push_back(item);
+    }
+    if(values.empty()) {
+        error = "No values given for " + name;
+        return false;
+    }
+    return true;
+}
+
+static std::string FormatFixed(double value, int precision) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(precision) << value;
+    return text.str();
+}
+
+//One combination of the sweep and its outcome
+struct SweepRun {
+    JobParams params;
+    JobResult result;
+    float color_error;
+
+    SweepRun() : color_error(0) {}
+};
+
+//Returns the file name of the output image of a run, naming every swept
+//parameter
+static std::string RunName(const JobParams& params, const std::string& format) {
+    std::ostringstream name;
+    name << "w" << params.width << "_h" << params.height << "_p" << params.numcolors
+         << "_l" << params.slic_factor << "_c" << params.sigma_color
+         << "_s" << params.sigma_position;
+    std::string schedule = params.schedule;
+    std::replace(schedule.begin(), schedule.end(), ':', '-');
+    name << "_" << schedule << format;
+    return name.str();
+}
+
+int SweepMain(int argc, char* argv[]) {
+    std::string inputfile;
+    std::string table_path;
+    std::string outdir;
+    std::string format;
+    int jobs;
+    JobParams base;
+    std::vector<int> widths, heights, numcolors, slic_factors;
+    std::vector<float> sigma_colors, sigma_positions;
+    std::vector<std::string> schedules;
+
+    try {
+        TCLAP::CmdLine cmd("Runs every combination of the given parameter values on one image and writes a table of iterations, wall time and color error per combination. Lists are comma separated values or first:last[:step] ranges. The input is decoded and converted to L*a*b* only once and shared by all runs.", ' ', "1.0");
+        TCLAP::UnlabeledValueArg<std::string> input_arg("in", "input filename", true, "", "input filename");
+        TCLAP::ValueArg<std::string> width_arg("", "width", "Output widths, 0 keeps the aspect ratio", false, "0", "list");
+        TCLAP::ValueArg<std::string> height_arg("", "height", "Output heights, 0 keeps the aspect ratio", false, "0", "list");
+        TCLAP::ValueArg<std::string> numcolors_arg("", "numcolors", "Output numbers of colors", true, "", "list");
+        TCLAP::ValueArg<std::string> slic_factor_arg("l", "slic-factor", "SLIC factors", false, "45", "list");
+        TCLAP::ValueArg<std::string> sigma_color_arg("c", "sigma", "Sigma values (color)", false, "2.0", "list");
+        TCLAP::ValueArg<std::string> sigma_position_arg("p", "sigmap", "Sigma values (position)", false, "0.97", "list");
+        TCLAP::ValueArg<std::string> schedule_arg("", "schedule", "Annealing schedules (geometric, adaptive, critical, budget:<iterations>), comma separated", false, "geometric", "list");
+        TCLAP::ValueArg<int> maxiter_arg("m", "max-iterations", "Maximum number of iterations", false, 128, "number iterations");
+        TCLAP::ValueArg<float> saturation_arg("t", "saturation", "Saturation value", false, 1.1f, "floating point value");
+        TCLAP::ValueArg<float> smooth_factor_arg("f", "smooth-factor", "Smooth factor", false, 0.1f, "floating point value");
+        TCLAP::SwitchArg use_alpha_arg("a", "use-alpha", "Use Alpha-Channel for Importance Sampling", false);
+        TCLAP::ValueArg<std::string> output_arg("o", "out", "file for the results table, defaults to stdout", false, "", "filename");
+        TCLAP::ValueArg<std::string> outdir_arg("d", "outdir", "also write the output image of every combination into this directory", false, "", "directory");
+        TCLAP::ValueArg<std::string> format_arg("", "format", "Extension and format of the output images", false, ".png", "extension");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of combinations run concurrently, 0 uses one per core", false, 0, "number jobs");
+        cmd.add(input_arg);
+        cmd.add(width_arg);
+        cmd.add(height_arg);
+        cmd.add(numcolors_arg);
+        cmd.add(slic_factor_arg);
+        cmd.add(sigma_color_arg);
+        cmd.add(sigma_position_arg);
+        cmd.add(schedule_arg);
+        cmd.add(maxiter_arg);
+        cmd.add(saturation_arg);
+        cmd.add(smooth_factor_arg);
+        cmd.add(use_alpha_arg);
+        cmd.add(output_arg);
+        cmd.add(outdir_arg);
+        cmd.add(format_arg);
+        cmd.add(jobs_arg);
+
+        cmd.parse( argc, argv );
+
+        inputfile = input_arg.getValue();
+        std::string error;
+        if(!ParseValues("--width", width_arg.getValue(), widths, error) ||
+           !ParseValues("--height", height_arg.getValue(), heights, error) ||
+           !ParseValues("--numcolors", numcolors_arg.getValue(), numcolors, error) ||
+           !ParseValues("--slic-factor", slic_factor_arg.getValue(), slic_factors, error) ||
+           !ParseValues("--sigma", sigma_color_arg.getValue(), sigma_colors, error) ||
+           !ParseValues("--sigmap", sigma_position_arg.getValue(), sigma_positions, error) ||
+           !ParseNames("--schedule", schedule_arg.getValue(), schedules, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        for(size_t i = 0; i < schedules.size(); ++i) {
+            if(!ParseAnnealingSchedule(schedules[i])) {
+                std::cerr << "Unknown annealing schedule " << schedules[i] << std::endl;
+                return 1;
+            }
+        }
+        base.max_iter = maxiter_arg.getValue();
+        base.saturation = saturation_arg.getValue();
+        base.smooth_factor = smooth_factor_arg.getValue();
+        base.use_alpha = use_alpha_arg.getValue();
+        table_path = output_arg.getValue();
+        outdir = outdir_arg.getValue();
+        format = format_arg.getValue();
+        jobs = jobs_arg.getValue();
+        if(jobs <= 0)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    //decode and convert once; every run attaches to the same read-only input
+    cv::Mat image, weights;
+    std::string error;
+    if(!PrepareInput(cv::imread(inputfile, DecodeFlags(base)), base, image, weights, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    PixInputPtr input = PixInput::FromRgb(image, weights);
+    image.release();
+    weights.release();
+
+    std::vector<SweepRun> runs;
+    for(size_t w = 0; w < widths.size(); ++w)
+    for(size_t h = 0; h < heights.size(); ++h)
+    for(size_t p = 0; p < numcolors.size(); ++p)
+    for(size_t l = 0; l < slic_factors.size(); ++l)
+    for(size_t c = 0; c < sigma_colors.size(); ++c)
+    for(size_t s = 0; s < sigma_positions.size(); ++s)
+    for(size_t a = 0; a < schedules.size(); ++a) {
+        SweepRun run;
+        run.params = base;
+        run.params.width = widths[w];
+        run.params.height = heights[h];
+        run.params.numcolors = numcolors[p];
+        run.params.slic_factor = slic_factors[l];
+        run.params.sigma_color = sigma_colors[c];
+        run.params.sigma_position = sigma_positions[s];
+        run.params.schedule = schedules[a];
+        runs.push_back(run);
+    }
+    std::cerr << runs.size() << " combinations on " << jobs << " threads" << std::endl;
+
+    if(!outdir.empty())
+        mkdir(outdir.c_str(), 0777);
+    //Runs are the unit of parallelism here
+    if(jobs > 1)
+        cv::setNumThreads(1);
+
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> finished(0);
+    std::mutex progress_mutex;
+    std::vector<std::thread> workers;
+    for(int i = 0; i < jobs; ++i) {
+        workers.push_back(std::thread([&]() {
+            for(size_t n = next++; n < runs.size(); n = next++) {
+                SweepRun& run = runs[n];
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                if(ValidateParams(run.params, run.result.error) &&
+                   ResolveOutputSize(run.params, input->width(), input->height(),
+                                     run.result.error)) {
+                    Pix* pix = CreatePix(input, run.params, ExecutorPtr());
+                    PixRunStatus status = RunPix(*pix, run.params, start,
+                                                 PixProgressCallback(), NULL);
+                    run.result.truncated = status == kRunDeadline;
+                    run.result.stop_reason = StopReason(*pix, status);
+                    run.result.iterations = pix->get_iteration();
+                    run.color_error = pix->GetColorError();
+                    run.result.ok = true;
+                    if(!outdir.empty()) {
+                        cv::Mat output;
+                        pix->GetOutputImage(output);
+                        std::string outputfile = outdir + "/" + RunName(run.params, format);
+                        if(!imwrite(outputfile, output)) {
+                            run.result.ok = false;
+                            run.result.error = "Could not write " + outputfile;
+                        }
+                    }
+                    delete pix;
+                }
+                run.result.wall_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                std::cerr << "\r" << ++finished << "/" << runs.size() << std::flush;
+            }
+        }));
+    }
+    for(size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    std::cerr << std::endl;
+
+    std::ofstream table_file;
+    if(!table_path.empty()) {
+        table_file.open(table_path.c_str());
+        if(!table_file) {
+            std::cerr << "Could not write " << table_path << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& table = table_path.empty() ? std::cout : table_file;
+    table << "width\theight\tnumcolors\tslic_factor\tsigma_color\tsigma_position\tschedule"
+          << "\tstatus\titerations\twall_ms\tstop\tcolor_error\tmessage" << std::endl;
+    int failures = 0;
+    for(size_t i = 0; i < runs.size(); ++i) {
+        const SweepRun& run = runs[i];
+        if(!run.result.ok)
+            failures++;
+        table << run.params.width << "\t" << run.params.height << "\t"
+              << run.params.numcolors << "\t" << run.params.slic_factor << "\t"
+              << run.params.sigma_color << "\t" << run.params.sigma_position << "\t"
+              << run.params.schedule << "\t"
+              << (run.result.ok ? "ok" : "failed") << "\t" << run.result.iterations << "\t"
+              << (long)run.result.wall_ms << "\t" << run.result.stop_reason << "\t"
+              << FormatFixed(run.color_error, 3) << "\t" << run.result.error << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+#include "commands.h"
+#include "job.h"
+#include "jobargs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tclap/CmdLine.h>
+
+//Layout of a spool directory:
+//
+//  incoming/  new jobs: an image, optionally with a sidecar file named
+//             <image>.params holding "key=value" job parameters (see
+//             ParseParams). Write the sidecar first, then move the image
+//             in with a rename so that workers never see a partial file.
+//  claimed/   jobs being processed, renamed to <image>.<worker pid>
+//  done/      results, named like the image with the output format's
+//             extension. The source image and sidecar are removed.
+//  failed/    the image and sidecar of failed jobs plus <image>.error
+static const char* kIncoming = "/incoming";
+static const char* kClaimed = "/claimed";
+static const char* kDone = "/done";
+static const char* kFailed = "/failed";
+static const char* kSidecar = ".params";
+
+static bool IsSidecar(const std::string& name) {
+    std::vector<std::string> extensions(1, kSidecar);
+    return endsWith(name, extensions);
+}
+
+//Lists the job images in incoming, skipping hidden files and sidecars
+static std::vector<std::string> ListIncoming(const std::string& spool) {
+    std::vector<std::string> names;
+    DIR* dir = opendir((spool + kIncoming).c_str());
+    if(!dir)
+        return names;
+    while(struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if(name.empty() || name[0] == '.' || IsSidecar(name))
+            continue;
+        names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+//Moves claims of workers that no longer run back to incoming, so jobs of a
+//crashed worker are not lost.
+static void RecoverStaleClaims(const std::string& spool) {
+    DIR* dir = opendir((spool + kClaimed).c_str());
+    if(!dir)
+        return;
+    while(struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        size_t dot = name.find_last_of('.');
+        if(name[0] == '.' || dot == std::string::npos)
+            continue;
+        pid_t pid = atoi(name.c_str() + dot + 1);
+        if(pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+            rename((spool + kClaimed + "/" + name).c_str(),
+                   (spool + kIncoming + "/" + name.substr(0, dot)).c_str());
+        }
+    }
+    closedir(dir);
+}
+
+//Returns the name of the result for an image name: the extension replaced
+//by format
+static std::string ResultName(const std::string& name, const std::string& format) {
+    size_t dot = name.find_last_of('.');
+    if(dot == std::string::npos || dot == 0)
+        return name + format;
+    return name.substr(0, dot) + format;
+}
+
+//Claims and processes the job for image name. Returns false if another
+//worker claimed it first.
+static bool RunJob(const std::string& spool, const std::string& name,
+                   const JobParams& defaults, const std::string& format,
+                   ResultCache* cache) {
+    std::ostringstream suffix;
+    suffix << "." << getpid();
+    std::string image = spool + kClaimed + "/" + name + suffix.str();
+    std::string sidecar = spool + kClaimed + "/" + name + kSidecar + suffix.str();
+
+    //rename is atomic: exactly one worker succeeds
+    if(rename((spool + kIncoming + "/" + name).c_str(), image.c_str()) != 0)
+        return false;
+    bool has_sidecar = rename((spool + kIncoming + "/" + name + kSidecar).c_str(),
+                              sidecar.c_str()) == 0;
+
+    JobParams params = defaults;
+    JobResult result;
+    bool valid;
+    if(has_sidecar) {
+        std::ifstream file(sidecar.c_str());
+        std::stringstream text;
+        text << file.rdbuf();
+        valid = ParseParams(text.str(), params, NULL, result.error);
+    } else {
+        valid = ValidateParams(params, result.error);
+    }
+
+    std::string result_name = ResultName(name, format);
+    if(valid) {
+        //write under a hidden name and rename, so done/ only ever holds
+        //complete results
+        std::string temporary = spool + kDone + "/." + suffix.str().substr(1) + "-" + result_name;
+        //an image that makes the decoder or the algorithm throw fails like
+        //any other job instead of taking the worker down with it
+        try {
+            result = ProcessFile(image, temporary, params, cache, ExecutorPtr());
+        } catch(const std::exception& e) {
+            result = JobResult();
+            result.error = std::string("The job failed: ") + e.what();
+        } catch(...) {
+            result = JobResult();
+            result.error = "The job failed";
+        }
+        if(result.ok && rename(temporary.c_str(),
+                               (spool + kDone + "/" + result_name).c_str()) != 0) {
+            result.ok = false;
+            result.error = "Could not move the result to done";
+        }
+        if(!result.ok)
+            unlink(temporary.c_str());
+    }
+
+    if(result.ok) {
+        unlink(image.c_str());
+        if(has_sidecar)
+            unlink(sidecar.c_str());
+        std::cout << (result.cached ? "cached " : "done   ") << name << " ("
+                  << result.iterations << " iterations, "
+                  << (long)result.wall_ms << " ms"
+                  << (result.stop_reason.empty() ? "" : ", " + result.stop_reason)
+                  << ")" << std::endl;
+    } else {
+        std::string failed = spool + kFailed + "/" + name;
+        rename(image.c_str(), failed.c_str());
+        if(has_sidecar)
+            rename(sidecar.c_str(), (failed + kSidecar).c_str());
+        std::ofstream error((failed + ".error").c_str());
+        error << result.error << std::endl;
+        std::cout << "failed " << name << ": " << result.error << std::endl;
+    }
+    return true;
+}
+
+int WatchMain(int argc, char* argv[]) {
+    std::string spool;
+    std::string format;
+    bool once;
+    JobParams defaults;
+    ResultCache* cache;
+
+    try {
+        TCLAP::CmdLine cmd("Watches a spool directory and processes the images dropped into its incoming/ directory. Several workers can share a spool: jobs are claimed by an atomic rename. Parameters default to the command line and can be overridden per image by a <image>.params sidecar file.", ' ', "1.0");
+        TCLAP::UnlabeledValueArg<std::string> spool_arg("spool", "spool directory, incoming/, claimed/, done/ and failed/ are created in it", true, "", "directory");
+        TCLAP::ValueArg<int> target_width_arg("", "width", "Default output width, 0 keeps the aspect ratio", false, 0, "width");
+        TCLAP::ValueArg<int> target_height_arg("", "height", "Default output height, 0 keeps the aspect ratio", false, 0, "height");
+        TCLAP::ValueArg<int> target_numcolors_arg("", "numcolors", "Default number of output colors", false, 8, "number colors");
+        TCLAP::ValueArg<std::string> format_arg("", "format", "Format of the results", false, ".png", "extension");
+        TCLAP::SwitchArg once_arg("", "once", "Exit once incoming/ is empty instead of waiting for new jobs", false);
+        JobArgs job_args;
+        CacheArgs cache_args;
+        cmd.add(spool_arg);
+        cmd.add(target_width_arg);
+        cmd.add(target_height_arg);
+        cmd.add(target_numcolors_arg);
+        cmd.add(format_arg);
+        cmd.add(once_arg);
+        job_args.AddTo(cmd);
+        cache_args.AddTo(cmd);
+
+        cmd.parse( argc, argv );
+
+        spool = spool_arg.getValue();
+        defaults.width = target_width_arg.getValue();
+        defaults.height = target_height_arg.getValue();
+        defaults.numcolors = target_numcolors_arg.getValue();
+        job_args.Get(defaults);
+        format = format_arg.getValue();
+        once = once_arg.getValue();
+        cache = cache_args.Create();
+    }
+    // catch any cmdline exceptions
+    catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    const char* subdirectories[] = {kIncoming, kClaimed, kDone, kFailed};
+    mkdir(spool.c_str(), 0777);
+    for(int i = 0; i < 4; ++i) {
+        mkdir((spool + subdirectories[i]).c_str(), 0777);
+    }
+    RecoverStaleClaims(spool);
+
+    //watch before the first scan, so no job dropped in between is missed
+    int inotify_fd = inotify_init();
+    if(inotify_fd < 0 || inotify_add_watch(inotify_fd, (spool + kIncoming).c_str(),
+                                           IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+        std::cerr << "Could not watch " << spool << kIncoming << std::endl;
+        return 1;
+    }
+
+    std::vector<char> events(64 * (sizeof(inotify_event) + NAME_MAX + 1));
+    while(true) {
+        //process until incoming is drained; other workers may take some jobs
+        std::vector<std::string> names = ListIncoming(spool);
+        bool claimed_any = false;
+        for(size_t i = 0; i < names.size(); ++i) {
+            if(RunJob(spool, names[i], defaults, format, cache))
+                claimed_any = true;
+        }
+        if(claimed_any)
+            continue;
+        if(once)
+            return 0;
+
+        //sleep until something arrives; the events themselves are not
+        //needed since the next scan finds the new jobs
+        ssize_t n = read(inotify_fd, &events[0], events.size());
+        if(n < 0 && errno != EINTR) {
+            std::cerr << "Could not read inotify events" << std::endl;
+            return 1;
+        }
+    }
+}
@@ -62,4 +62,8 @@ namespace pix_research{
   const std::string kFontStyle = "Tahoma";
   const int kFontSize = 18;
 
+  //length of the slices the worker iterates in, which bounds how long 
+  //resetting or closing waits for it
+  const double kIterationBudgetMs = 30.0;
+
 }
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include "executor.h"
+
+#include <algorithm>
+
+void SerialExecutor::ParallelFor(int count, 
+  const std::function<void(int)>& task) {
+  for(int i = 0; i<count; ++i) {
+    task(i);
+  }
+}
+ExecutorPtr SerialExecutor::Shared() {
+  static ExecutorPtr executor(new SerialExecutor());
+  return executor;
+}
+
+//the pool and deque index of the worker running on this thread
+static thread_local const ThreadPoolExecutor * current_pool = NULL;
+static thread_local int current_index = -1;
+
+ThreadPoolExecutor::ThreadPoolExecutor(int threads) 
+  : queued_(0), stealable_(0), stop_(false) {
+  if(threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  for(int i = 0; i<=threads; ++i) {
+    deques_.push_back(new TaskDeque());
+  }
+  for(int i = 0; i<threads; ++i) {
+    workers_.push_back(std::thread(&ThreadPoolExecutor::WorkerLoop, this, i));
+  }
+}
+ThreadPoolExecutor::~ThreadPoolExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for(int i = 0; i<workers_.size(); ++i) {
+    workers_[i].join();
+  }
+  for(int i = 0; i<deques_.size(); ++i) {
+    delete deques_[i];
+  }
+}
+
+void ThreadPoolExecutor::ParallelFor(int count, 
+  const std::function<void(int)>& task) {
+  if(count <= 0)
+    return;
+  if(count == 1) {
+    task(0);
+    return;
+  }
+
+  Batch batch;
+  batch.pending = count;
+  //workers take their own tasks newest first and everyone else takes the
+  //oldest, so queue in the order that starts with task 0 either way
+  bool worker = CurrentWorker() >= 0;
+  for(int n = 0; n<count; ++n) {
+    int i = worker ? count-1-n : n;
+    Task * queued = new Task();
+    queued->run = [&task, i]() {task(i);};
+    queued->batch = &batch;
+    Push(queued);
+  }
+
+  //A thread outside the pool only waits: tasks it ran would start 
+  //further top-level tasks (e.g. whole images) from the shared deque and
+  //nest them inside each other on its stack.
+  if(!worker) {
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    waiting_.wait(lock, [&batch]() {return batch.pending.load() == 0;});
+  }
+
+  //A worker helps instead of blocking, which also keeps nested calls from
+  //deadlocking. It only helps with tasks spawned by other tasks and 
+  //leaves the shared deque alone: a new top-level task would delay this 
+  //call by its full length. With no such task queued it sleeps.
+  while(batch.pending.load() > 0) {
+    Task * next = Pop(false);
+    if(next) {
+      Run(next);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    if(batch.pending.load() == 0)
+      break;
+    if(stealable_.load() == 0)
+      waiting_.wait(lock);
+  }
+  if(batch.error)
+    std::rethrow_exception(batch.error);
+}
+
+int ThreadPoolExecutor::CurrentWorker() const {
+  return current_pool == this ? current_index : -1;
+}
+
+void ThreadPoolExecutor::Push(Task * task) {
+  int index = CurrentWorker();
+  TaskDeque * deque = deques_[index >= 0 ? index : workers_.size()];
+  {
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    deque->tasks.push_back(task);
+  }
+  if(index >= 0)
+    stealable_++;
+  queued_++;
+  //taking the lock orders this push before a sleeper's check of the counts
+  { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+  //only idle workers sleep on wake_, and any of them can take the task.
+  //A worker's task may also be taken by the threads waiting for nested 
+  //tasks.
+  wake_.notify_one();
+  if(index >= 0)
+    waiting_.notify_all();
+}
+
+ThreadPoolExecutor::Task * ThreadPoolExecutor::Pop(bool use_shared) {
+  if(queued_.load() == 0)
+    return NULL;
+  int self = CurrentWorker();
+  int shared = workers_.size();
+  if(self >= 0) {
+    TaskDeque * own = deques_[self];
+    std::lock_guard<std::mutex> lock(own->mutex);
+    if(!own->tasks.empty()) {
+      Task * task = own->tasks.back();
+      own->tasks.pop_back();
+      stealable_--;
+      queued_--;
+      return task;
+    }
+  }
+  //the shared deque first, then the other workers starting after self
+  for(int i = -1; i<shared; ++i) {
+    int index = i < 0 ? shared : (self + 1 + i) % shared;
+    if(index == self || (index == shared && !use_shared))
+      continue;
+    TaskDeque * deque = deques_[index];
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    if(!deque->tasks.empty()) {
+      Task * task = deque->tasks.front();
+      deque->tasks.pop_front();
+      if(index != shared)
+        stealable_--;
+      queued_--;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+void ThreadPoolExecutor::Run(Task * task) {
+  try {
+    task->run();
+  } catch(...) {
+    std::lock_guard<std::mutex> lock(task->batch->mutex);
+    if(!task->batch->error)
+      task->batch->error = std::current_exception();
+  }
+  Batch * batch = task->batch;
+  delete task;
+  //the waiting thread may destroy the batch as soon as pending reaches 0
+  if(--batch->pending == 0) {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    waiting_.notify_all();
+  }
+}
+
+void ThreadPoolExecutor::WorkerLoop(int index) {
+  current_pool = this;
+  current_index = index;
+  while(true) {
+    Task * task = Pop(true);
+    if(task) {
+      Run(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    if(stop_)
+      return;
+    if(queued_.load() == 0)
+      wake_.wait(lock);
+  }
+}
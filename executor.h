@@ -0,0 +1,120 @@
+/* 
+Description: Executors run the parallel stages of the algorithm. Pix splits
+every parallel stage into a fixed number of independent tasks and hands them
+to its executor, so the result never depends on the executor or its thread
+count. Applications that have their own scheduler implement Executor; the
+library provides a serial executor and a work-stealing thread pool.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Executor {
+ public:
+  virtual ~Executor() {}
+
+  //Runs task(0) ... task(count-1) and returns once all of them finished. 
+  //The tasks may run concurrently and in any order. If a task throws, the
+  //first exception is rethrown once all tasks finished.
+  virtual void ParallelFor(int count, const std::function<void(int)>& task) = 0;
+
+  //Returns how many tasks can run at the same time, which callers use to
+  //size the batches they hand to ParallelFor()
+  virtual int concurrency() const {return 1;}
+};
+
+typedef std::shared_ptr<Executor> ExecutorPtr;
+
+//Runs the tasks one after the other on the calling thread, in order
+class SerialExecutor : public Executor {
+ public:
+  virtual void ParallelFor(int count, const std::function<void(int)>& task);
+
+  //returns a serial executor shared by everyone, the default of Pix
+  static ExecutorPtr Shared();
+};
+
+//A pool of worker threads with one task deque per worker, plus a shared 
+//deque for tasks queued from outside the pool. A worker takes its newest
+//task first, then the oldest shared task, and when both are empty steals
+//the oldest task of another worker. Tasks spawned by tasks thus stay on the
+//core that spawned them while idle cores take over the remaining work. 
+//A worker waiting in ParallelFor() runs tasks spawned by tasks itself 
+//instead of blocking, which makes nested ParallelFor() calls from within
+//tasks safe. A thread outside the pool only waits for its tasks.
+//
+//Nesting is the intended use for many jobs of different sizes: queue the 
+//jobs with one ParallelFor() from outside the pool and give each job's Pix
+//the same pool. The calling thread does not take jobs, so size the pool 
+//for all the cores. Workers start new jobs while there are any and then steal 
+//stage tasks from the jobs still running, so large and small jobs share
+//the cores without tuning.
+class ThreadPoolExecutor : public Executor {
+ public:
+  //Starts threads workers; 0 uses one per core.
+  explicit ThreadPoolExecutor(int threads);
+  virtual ~ThreadPoolExecutor();
+
+  virtual void ParallelFor(int count, const std::function<void(int)>& task);
+  virtual int concurrency() const {return size();}
+
+  inline int size() const {return workers_.size();}
+
+ private:
+  //tasks of one ParallelFor() call
+  struct Batch {
+    std::atomic<int> pending;
+    std::mutex mutex;
+    std::exception_ptr error;
+  };
+  struct Task {
+    std::function<void()> run;
+    Batch * batch;
+  };
+  struct TaskDeque {
+    std::mutex mutex;
+    std::deque<Task *> tasks;
+  };
+
+  ThreadPoolExecutor(const ThreadPoolExecutor&);
+  ThreadPoolExecutor& operator=(const ThreadPoolExecutor&);
+
+  //returns the index of the calling thread's deque if it is a worker of 
+  //this pool, -1 otherwise
+  int CurrentWorker() const;
+
+  //queues a task on the calling worker's deque, or on the shared deque for
+  //threads outside the pool
+  void Push(Task * task);
+
+  //takes a task for the calling worker: the newest of its own deque, then
+  //the oldest of the shared deque if use_shared is set, then the oldest of
+  //another worker's deque. Returns NULL if there is none.
+  Task * Pop(bool use_shared);
+
+  //runs a task and marks it finished in its batch
+  void Run(Task * task);
+
+  void WorkerLoop(int index);
+
+  std::vector<std::thread> workers_;
+  //one deque per worker, followed by the shared deque
+  std::vector<TaskDeque *> deques_;
+  //all queued tasks, and those on the workers' deques, which threads 
+  //waiting for nested tasks may take
+  std::atomic<int> queued_, stealable_;
+  std::mutex sleep_mutex_;
+  //idle workers sleep on wake_, threads waiting in ParallelFor() on 
+  //waiting_
+  std::condition_variable wake_, waiting_;
+  bool stop_;
+};
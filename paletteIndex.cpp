@@ -0,0 +1,95 @@
+#include "paletteIndex.h"
+
+#include <algorithm>
+
+PaletteIndex::PaletteIndex() : root_(-1) {
+}
+void PaletteIndex::Build(const std::vector<cv::Vec3f>& colors) {
+  colors_ = colors;
+  nodes_.clear();
+  nodes_.reserve(colors_.size());
+  std::vector<int> order(colors_.size());
+  for(int i = 0; i<order.size(); ++i) {
+    order[i] = i;
+  }
+  root_ = BuildNode(order, 0, order.size());
+}
+int PaletteIndex::BuildNode(std::vector<int>& order, int begin, int end) {
+  if(begin >= end)
+    return -1;
+
+  //split along the axis the colors spread most on, at the median
+  cv::Vec3f low = colors_[order[begin]], high = low;
+  for(int i = begin + 1; i<end; ++i) {
+    const cv::Vec3f& color = colors_[order[i]];
+    for(int c = 0; c<3; ++c) {
+      low[c] = std::min(low[c], color[c]);
+      high[c] = std::max(high[c], color[c]);
+    }
+  }
+  int axis = 0;
+  for(int c = 1; c<3; ++c) {
+    if(high[c] - low[c] > high[axis] - low[axis])
+      axis = c;
+  }
+  int middle = begin + (end - begin)/2;
+  std::nth_element(order.begin() + begin, order.begin() + middle, 
+    order.begin() + end, [&](int a, int b) {
+      return colors_[a][axis] < colors_[b][axis];
+  });
+
+  int node = nodes_.size();
+  Node split = {order[middle], axis, -1, -1};
+  nodes_.push_back(split);
+  int left = BuildNode(order, begin, middle);
+  int right = BuildNode(order, middle + 1, end);
+  nodes_[node].left = left;
+  nodes_[node].right = right;
+  return node;
+}
+int PaletteIndex::Nearest(const cv::Vec3f& color, double& distance) const {
+  int best = -1;
+  distance = 0;
+  NearestIn(root_, color, best, distance);
+  return best;
+}
+void PaletteIndex::NearestIn(int node, const cv::Vec3f& color, int& best, 
+  double& best_distance) const {
+  if(node < 0)
+    return;
+  const Node& split = nodes_[node];
+  double distance = norm(colors_[split.color], color);
+  if(best == -1 || distance < best_distance || 
+    (distance == best_distance && split.color < best)) {
+      best = split.color;
+      best_distance = distance;
+  }
+
+  //the side of the query first; the other side only if it can hold a 
+  //color as close, equally close ones included for the lowest index
+  double offset = color[split.axis] - colors_[split.color][split.axis];
+  int near = offset < 0 ? split.left : split.right;
+  int far = offset < 0 ? split.right : split.left;
+  NearestIn(near, color, best, best_distance);
+  if(std::abs(offset) <= best_distance)
+    NearestIn(far, color, best, best_distance);
+}
+void PaletteIndex::WithinRadius(const cv::Vec3f& color, double radius, 
+  std::vector<int>& indices) const {
+  size_t first = indices.size();
+  WithinRadiusIn(root_, color, radius, indices);
+  std::sort(indices.begin() + first, indices.end());
+}
+void PaletteIndex::WithinRadiusIn(int node, const cv::Vec3f& color, 
+  double radius, std::vector<int>& indices) const {
+  if(node < 0)
+    return;
+  const Node& split = nodes_[node];
+  if(norm(colors_[split.color], color) <= radius)
+    indices.push_back(split.color);
+  double offset = color[split.axis] - colors_[split.color][split.axis];
+  if(offset - radius <= 0)
+    WithinRadiusIn(split.left, color, radius, indices);
+  if(offset + radius >= 0)
+    WithinRadiusIn(split.right, color, radius, indices);
+}
@@ -0,0 +1,58 @@
+/* 
+Description: A k-d tree over the L*a*b* colors of a palette. It finds the
+color closest to a query color, and the colors within a distance of it, 
+with about log(K) instead of K distance computations, which matters for 
+palettes of 128 colors and more. The tree is built from a copy of the 
+palette and does not follow changes of it: rebuild it when the colors 
+change.
+*/
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+class PaletteIndex {
+ public:
+  PaletteIndex();
+
+  //Indexes colors, replacing the colors indexed before
+  void Build(const std::vector<cv::Vec3f>& colors);
+
+  //returns whether the index holds exactly the given colors
+  inline bool Indexes(const std::vector<cv::Vec3f>& colors) const {
+    return colors == colors_;
+  }
+
+  //Returns the index of the color closest to color, the lowest index of 
+  //equally close ones like a scan of the palette, and sets distance to 
+  //its distance. Returns -1 if the palette is empty.
+  int Nearest(const cv::Vec3f& color, double& distance) const;
+
+  //Appends the index of every color at most radius away from color to 
+  //indices, in ascending order
+  void WithinRadius(const cv::Vec3f& color, double radius, 
+    std::vector<int>& indices) const;
+
+  inline int size() const {return colors_.size();}
+
+ private:
+  //every node holds one color and splits the colors below it at that 
+  //color's value on axis
+  struct Node {
+    int color, axis, left, right;
+  };
+
+  //Builds the subtree of order[begin, end) and returns its node, -1 if 
+  //the range is empty
+  int BuildNode(std::vector<int>& order, int begin, int end);
+
+  void NearestIn(int node, const cv::Vec3f& color, int& best, 
+    double& best_distance) const;
+  void WithinRadiusIn(int node, const cv::Vec3f& color, double radius, 
+    std::vector<int>& indices) const;
+
+  std::vector<cv::Vec3f> colors_;
+  std::vector<Node> nodes_;
+  int root_;
+};
@@ -26,16 +26,66 @@ Author: Timothy Gerstner, timgerst@cs.rutgers.edu
 #include "pix.h"
 
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+//OpenCV fills the lookup tables of its L*a*b* conversions on first use 
+//without synchronization. Filling them once up front keeps concurrent 
+//instances from racing on them.
+static void InitColorTables() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    cv::Mat rgb(cv::Size(1,1), CV_32FC3, cv::Scalar(0.5f, 0.5f, 0.5f));
+    cv::Mat lab, back;
+    cv::cvtColor(rgb, lab, CV_RGB2Lab);
+    cv::cvtColor(lab, back, CV_Lab2RGB);
+  });
+}
+
+PixInputPtr PixInput::FromRgb(const cv::Mat& img_rgb, const cv::Mat& weights) {
+  InitColorTables();
+  std::shared_ptr<PixInput> input(new PixInput());
+  cvtColor(img_rgb, input->lab_, CV_RGB2Lab);
+  input->SetWeights(weights);
+  return input;
+}
+PixInputPtr PixInput::FromLab(const cv::Mat& img_lab, const cv::Mat& weights) {
+  std::shared_ptr<PixInput> input(new PixInput());
+  input->lab_ = img_lab.clone();
+  input->SetWeights(weights);
+  return input;
+}
+PixInputPtr PixInput::WithWeights(const cv::Mat& weights) const {
+  std::shared_ptr<PixInput> input(new PixInput());
+  input->lab_ = lab_;
+  input->SetWeights(weights);
+  return input;
+}
+void PixInput::SetWeights(const cv::Mat& weights) {
+  if(weights.empty())
+    weights_ = cv::Mat(lab_.size(), CV_32FC1, cv::Scalar(1.0f));
+  else
+    weights_ = weights.clone();
+}
 
-Pix::Pix(const cv::Mat& img_input, int w, int h, int p) {
+Pix::Pix(const cv::Mat& img_input, int w, int h, int p)
+  : Pix(PixInput::FromRgb(img_input, cv::Mat()), w, h, p) {
+}
+Pix::Pix(const PixInputPtr& input, int w, int h, int p) 
+  : rng_(kDefaultSeed), executor_(SerialExecutor::Shared()) {
+  InitColorTables();
   output_width_ = w;
   output_height_ = h;
   max_palette_size_ = p;
-  input_width_ = img_input.cols;
-  input_height_ = img_input.rows;
+  input_ = input;
+  input_img_ = input->lab();
+  input_weights_ = input->weights();
+  input_width_ = input->width();
+  input_height_ = input->height();
 
-  input_weights_ = 
-    cv::Mat(cv::Size(input_width_, input_height_), CV_32FC1, cv::Scalar(1.0f));
   slic_factor_ = 45;
   smooth_pos_factor_ = .4f;
   sigma_color_	= .87f;
@@ -43,14 +93,41 @@ Pix::Pix(const cv::Mat& img_input, int w, int h, int p) {
   state_list_ = new stateList(kMaxUndo);
   converged_flag_ = false;
   palette_maxed_flag_ = false;
+  palette_error_ = 0;
+  iteration_ms_ = association_ms_ = superpixel_pass_ms_ = 0;
+  convergence_ = kNotConverged;
+  assignment_churn_ = superpixel_movement_ = 0;
+  stall_iterations_ = 0;
+  set_palette_acceleration(false);
+  seeding_ = kSeedSplit;
+  binned_palette_ = binned_association_ = false;
+  set_sparse_association(0);
+  sparse_width_ = 0;
+  palette_indexed_ = false;
+  max_prob_c_ = 0;
+  temperature_ = kTF;
+  set_schedule(AnnealingSchedulePtr());
   GetCurrentState()->saturation = 1.1;
-
-  cvtColor(img_input, input_img_,CV_RGB2Lab);
+  ResetStep();
 }
-Pix::Pix(std::string filename) {
+Pix::Pix(std::string filename) 
+  : rng_(kDefaultSeed), executor_(SerialExecutor::Shared()) {
+  InitColorTables();
   std::vector<std::string> extensions;
   cv::FileStorage file_storage(filename, cv::FileStorage::READ);
   state_list_ = new stateList(kMaxUndo);
+  ResetStep();
+  temperature_ = kTF;
+  set_schedule(AnnealingSchedulePtr());
+  assignment_churn_ = superpixel_movement_ = 0;
+  stall_iterations_ = 0;
+  set_palette_acceleration(false);
+  seeding_ = kSeedSplit;
+  binned_palette_ = binned_association_ = false;
+  set_sparse_association(0);
+  sparse_width_ = 0;
+  palette_indexed_ = false;
+  max_prob_c_ = 0;
 
   //load orignal image
   file_storage["input_width_"] >> input_width_;
@@ -137,6 +214,9 @@ Pix::Pix(std::string filename) {
   //load weights
   input_weights_ = cv::Mat(cv::Size(input_width_, input_height_), CV_32FC1);
   file_storage["input_weights_"] >> input_weights_;
+  input_ = PixInput::FromLab(input_img_, input_weights_);
+  input_img_ = input_->lab();
+  input_weights_ = input_->weights();
 
   file_storage["iteration"] >> GetCurrentState()->iteration;
   file_storage["slic_factor_"] >> slic_factor_;
@@ -147,17 +227,26 @@ Pix::Pix(std::string filename) {
   //assume state was saved after initial convergence
   palette_maxed_flag_ = true;
   converged_flag_ = true;
-  temperature_ = kTF;
+  convergence_ = kConvergedPaletteError;
+  temperature_ = schedule_->final_temperature();
+  palette_error_ = 0;
+  iteration_ms_ = association_ms_ = superpixel_pass_ms_ = 0;
 
   UpdateSuperpixelMapping();
   UpdateSuperpixelMeans();
   AssociatePalette();
+  PublishResult();
 
   file_storage.release();
 }
 Pix::~Pix() {
   delete state_list_;
 }
+void Pix::set_schedule(const AnnealingSchedulePtr& schedule) {
+  schedule_ = schedule ? schedule 
+    : AnnealingSchedulePtr(new GeometricSchedule());
+  schedule_->Start(temperature_);
+}
 void Pix::Initialize()
 {
 
@@ -198,43 +287,185 @@ void Pix::Initialize()
     }
   }
 
-  //find mean color of each superpixel superpixel
+  //find mean color of each superpixel superpixel. The pass over the input
+  //pixels is the lower bound of the first iteration's cost, the rest is
+  //added by the palette initialization below.
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point means_start = Clock::now();
   GetCurrentState()->superpixel_color = 
     cv::Mat(cv::Size(output_width_, output_height_),CV_32FC3);
   UpdateSuperpixelMeans();
+  iteration_ms_ = (float)std::chrono::duration<double, std::milli>(
+    Clock::now() - means_start).count();
+
+  //set all pixels and colors to be unconstrained
+  GetCurrentState()->locked_colors = 
+    std::vector<bool>(max_palette_size_, false);
+  GetCurrentState()->pixel_constraints = 
+    std::vector<std::list<int> >(output_width_*output_height_);
+  prob_o_ = 1.0f/(output_width_*output_height_);
+
+  std::vector<cv::Vec3f> seeds;
+  if(seeding_ == kSeedKMeansPlusPlus)
+    seeds = SeedKMeansPlusPlus();
+  else if(seeding_ == kSeedHistogram)
+    seeds = SeedHistogram();
+  if(!seeds.empty()) {
+    InitializeSeededPalette(seeds);
+    iteration_ms_ += association_ms_;
+    PublishResult();
+    return;
+  }
 
   //Initialize the palette to 1 color = the mean of all input pixels
+  Clock::time_point pass_start = Clock::now();
   cv::Vec3f first_color(0.0f,0.0f,0.0f);
   for(int y = 0; y<output_height_; ++y) {
     for(int x = 0; x<output_width_; ++x) {
       first_color+= GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
     }
   }
+  superpixel_pass_ms_ = (float)std::chrono::duration<double, std::milli>(
+    Clock::now() - pass_start).count();
 
-  //Initialize P(p_i), P(c_k), P(c_k|p_i)
-  prob_o_ = 1.0f/(output_width_*output_height_);
+  //Initialize P(c_k), P(c_k|p_i)
+  BinSuperpixelColors();
   GetCurrentState()->prob_c.push_back(.5f);
   GetCurrentState()->prob_c.push_back(.5f);
-  prob_co_.push_back(cv::vector<float>(output_width_*output_height_,.5f));
-  prob_co_.push_back(cv::vector<float>(output_width_*output_height_,.5f));
+  if(sparse_max_colors_ > 0) {
+    sparse_width_ = 2;
+    sparse_counts_.assign(palette_samples(), 2);
+    sparse_probs_.assign(2*palette_samples(), .5f);
+    sparse_colors_.resize(2*palette_samples());
+    for(int i = 0; i<sparse_colors_.size(); ++i) {
+      sparse_colors_[i] = i%2;
+    }
+  } else {
+    prob_co_.push_back(cv::vector<float>(palette_samples(),.5f));
+    prob_co_.push_back(cv::vector<float>(palette_samples(),.5f));
+  }
 
   first_color *= prob_o_;
   GetCurrentState()->palette.push_back(first_color);
+  //the eigen decomposition visits every sample once for one color, like 
+  //the association does for each color of the palette: it stands in for 
+  //the first association, so RunUntil() keeps a reserve from the start
+  Clock::time_point eigen_start = Clock::now();
   GetCurrentState()->palette.push_back(first_color +
     GetMaxEigen(0).first*kSubclusterPertubation);
+  association_ms_ = GetCurrentState()->palette.size()*
+    (float)std::chrono::duration<double, std::milli>(
+    Clock::now() - eigen_start).count();
+  iteration_ms_ += association_ms_;
   GetCurrentState()->sub_superpixel_pairs.push_back(std::pair<int,int>(0,1));
 
   //set starting temperature
   temperature_ = kT0SafteyFactor*sqrt(2*GetMaxEigen(0).second);
+  schedule_->Start(temperature_);
+
+  PublishResult();
 
-  //set all pixels and colors to be unconstrained
-  GetCurrentState()->locked_colors = 
-    std::vector<bool>(max_palette_size_, false);
-  GetCurrentState()->pixel_constraints = 
-    std::vector<std::list<int> >(output_width_*output_height_);
 
 
+}
+std::vector<cv::Vec3f> Pix::SeedKMeansPlusPlus() {
+  //sample the superpixels, all of them if there are few
+  int count = output_width_*output_height_;
+  int samples = std::min(count, kSeedSamples);
+  std::vector<cv::Vec3f> colors(samples);
+  std::vector<double> weights(samples);
+  for(int i = 0; i<samples; ++i) {
+    int index = samples == count ? i : rng_.uniform(0, count);
+    int y = index/output_width_, x = index%output_width_;
+    colors[i] = GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
+    weights[i] = superpixel_weights_.at<float>(y,x);
+  }
+
+  //pick each seed with a probability proportional to the sample's weight,
+  //times its squared distance to the closest seed after the first
+  std::vector<cv::Vec3f> seeds;
+  std::vector<double> distances(samples, 1.0);
+  while(seeds.size() < max_palette_size_) {
+    double total = 0;
+    for(int i = 0; i<samples; ++i) {
+      total += weights[i]*distances[i];
+    }
+    if(total <= 0) break; //every sample is a seed already
+    double target = rng_.uniform(0.0, total);
+    int pick = 0;
+    for(; pick<samples-1; ++pick) {
+      target -= weights[pick]*distances[pick];
+      if(target < 0) break;
+    }
+    seeds.push_back(colors[pick]);
+    for(int i = 0; i<samples; ++i) {
+      cv::Vec3f error = colors[i] - seeds.back();
+      double distance = error.dot(error);
+      distances[i] = seeds.size() == 1 ? distance 
+        : std::min(distances[i], distance);
+    }
+  }
+  return seeds;
+}
+std::vector<cv::Vec3f> Pix::SeedHistogram() {
+  //weight and weighted color sum of every occupied bin
+  std::map<int, std::pair<double, cv::Vec3d> > bins;
+  for(int y = 0; y<output_height_; ++y) {
+    for(int x = 0; x<output_width_; ++x) {
+      cv::Vec3f color = GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
+      double weight = superpixel_weights_.at<float>(y,x);
+      if(weight <= 0) continue;
+      //L* is in [0,100], a* and b* within [-128,128]
+      int l = (int)(color[0]/kSeedBinSize);
+      int a = (int)((color[1]+128)/kSeedBinSize);
+      int b = (int)((color[2]+128)/kSeedBinSize);
+      std::pair<double, cv::Vec3d>& bin = bins[(l*64 + a)*64 + b];
+      bin.first += weight;
+      bin.second += cv::Vec3d(color)*weight;
+    }
+  }
 
+  std::vector<std::pair<double, cv::Vec3f> > heaviest;
+  for(std::map<int, std::pair<double, cv::Vec3d> >::iterator bin = bins.begin();
+    bin != bins.end(); ++bin) {
+      heaviest.push_back(std::pair<double, cv::Vec3f>(bin->second.first, 
+        bin->second.second*(1.0/bin->second.first)));
+  }
+  std::stable_sort(heaviest.begin(), heaviest.end(), 
+    [](const std::pair<double, cv::Vec3f>& p, const std::pair<double, cv::Vec3f>& q) {
+      return p.first > q.first;
+    });
+  std::vector<cv::Vec3f> seeds;
+  for(int i = 0; i<heaviest.size() && i<max_palette_size_; ++i) {
+    seeds.push_back(heaviest[i].second);
+  }
+  return seeds;
+}
+void Pix::InitializeSeededPalette(const std::vector<cv::Vec3f>& seeds) {
+  //a full palette needs no subclusters
+  palette_maxed_flag_ = true;
+  GetCurrentState()->palette = seeds;
+  GetCurrentState()->prob_c = std::vector<float>(seeds.size(), 1.0f/seeds.size());
+
+  //associate at the final temperature, where the seeds do not share their
+  //superpixels, to measure the spread of every seeded color. It also gives
+  //RunUntil() its first estimate of the association.
+  temperature_ = schedule_->final_temperature();
+  std::chrono::steady_clock::time_point association_start = 
+    std::chrono::steady_clock::now();
+  AssociatePalette();
+  association_ms_ = (float)std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - association_start).count();
+
+  //start where the widest color would split: below the critical 
+  //temperatures of the unions of colors, so no two seeds merge
+  float start = temperature_;
+  for(int i = 0; i<seeds.size(); ++i) {
+    if(GetCurrentState()->prob_c[i] > 0)
+      start = std::max(start, (float)sqrt(2*GetMaxEigen(i).second));
+  }
+  temperature_ = start;
+  schedule_->Start(temperature_);
 }
 void Pix::SaveToFile(std::string filename) {
   std::vector<std::string> extensions;
@@ -312,81 +543,482 @@ void Pix::SaveToFile(std::string filename) {
 void Pix::Iterate() {
   if(converged_flag_) return;
 
-  //update segmentation
-  UpdateSuperpixelMapping();
-  UpdateSuperpixelMeans();
+  //runs a whole iteration, or the rest of one started by Step(), with 
+  //whole stages handed to the executor at once
+  while(!StepSlice(0)) {
+  }
+}
+PixStepStatus Pix::Step(double budget_ms) {
+  if(converged_flag_) return kStepConverged;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  do {
+    if(StepSlice(kStepBands))
+      return converged_flag_ ? kStepConverged : kStepIterated;
+  } while(std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count() < budget_ms);
+  return kStepInProgress;
+}
+//Blends a new measurement into a running cost estimate
+static void UpdateCost(float& estimate, double ms) {
+  estimate = estimate == 0 ? (float)ms 
+    : (1-kCostSmoothing)*estimate + kCostSmoothing*(float)ms;
+}
+PixRunStatus Pix::Run(int max_iter, const PixProgressCallback& progress, 
+  const PixCancelToken* cancel) {
+  return RunUntil(std::chrono::steady_clock::time_point::max(), max_iter,
+    progress, cancel);
+}
+PixRunStatus Pix::RunUntil(std::chrono::steady_clock::time_point deadline, 
+  int max_iter, const PixProgressCallback& progress, 
+  const PixCancelToken* cancel) {
+  typedef std::chrono::steady_clock Clock;
+  bool bounded = deadline != Clock::time_point::max();
+  //slices only as small as the checks need, and large enough for every
+  //thread of the executor
+  int slice_bands = bounded || cancel ? 
+    kStepBands*std::max(1, executor_->concurrency()) : 0;
+  for(int i = 0; i<max_iter && !converged_flag_; ++i) {
+    Clock::time_point iteration_start = Clock::now();
+    float reserve_ms = FinishEarlyReserve();
+    if(bounded && std::chrono::duration<double, std::milli>(
+      deadline - iteration_start).count() < iteration_ms_ + reserve_ms) {
+        FinishEarly();
+        return kRunDeadline;
+    }
 
+    bool completed = false;
+    double association_ms = 0;
+    do {
+      if(cancel && cancel->cancelled())
+        return kRunCancelled;
+      Clock::time_point slice_start = Clock::now();
+      if(bounded && std::chrono::duration<double, std::milli>(
+        deadline - slice_start).count() < reserve_ms) {
+          FinishEarly();
+          return kRunDeadline;
+      }
+      StepPhase phase = step_phase_;
+      completed = StepSlice(slice_bands);
+      if(phase == kPhaseAssociation) {
+        association_ms += std::chrono::duration<double, std::milli>(
+          Clock::now() - slice_start).count();
+      }
+    } while(!completed);
+    UpdateCost(iteration_ms_, std::chrono::duration<double, std::milli>(
+      Clock::now() - iteration_start).count());
+    UpdateCost(association_ms_, association_ms);
+
+    if(progress) {
+      PixProgress report;
+      report.iteration = GetCurrentState()->iteration;
+      report.temperature = temperature_;
+      report.palette_error = palette_error_;
+      report.palette_size = palette_maxed_flag_ ? GetCurrentState()->palette.size()
+        : GetCurrentState()->sub_superpixel_pairs.size();
+      report.assignment_churn = assignment_churn_;
+      report.superpixel_movement = superpixel_movement_;
+      progress(report);
+    }
+  }
+  return converged_flag_ ? kRunConverged : kRunMaxIterations;
+}
+bool Pix::StepSlice(int max_bands) {
+  switch(step_phase_) {
+  //update segmentation
+  case kPhaseMapping:
+    if(step_band_ == 0)
+      BeginSuperpixelMapping();
+    if(StepBands(input_height_, kInputBandRows, max_bands, [this](int, int begin, int end) {
+      MapSuperpixelRows(begin, end);
+    }))
+      return false;
+    FinishSuperpixelMapping();
+    break;
+  case kPhaseMeans:
+    if(step_band_ == 0)
+      BeginSuperpixelMeans();
+    if(StepBands(output_height_, kOutputBandRows, max_bands, [this](int, int begin, int end) {
+      SumSuperpixelRows(begin, end);
+    }))
+      return false;
+    FinishSuperpixelMeans();
+    break;
   //update palette
-  AssociatePalette();
-  float err_pal = RefinePalette();
-  if(err_pal < kPaletteErrorTolerance) {
-    if(temperature_ <= kTF)
+  case kPhaseAssociation:
+    if(step_band_ == 0)
+      BeginPaletteAssociation();
+    if(StepBands(palette_rows(), palette_band_rows(), max_bands, [this](int band, int begin, int end) {
+      AssociatePaletteRows(band, begin, end);
+    }))
+      return false;
+    FinishPaletteAssociation();
+    break;
+  case kPhaseRefinement:
+    if(step_band_ == 0)
+      BeginPaletteRefinement();
+    if(StepBands(palette_rows(), palette_band_rows(), max_bands, [this](int band, int begin, int end) {
+      SumPaletteRows(band, begin, end);
+    }))
+      return false;
+    FinishIteration(FinishPaletteRefinement());
+    ResetStep();
+    return true;
+  }
+  step_phase_ = (StepPhase)(step_phase_ + 1);
+  step_band_ = 0;
+  return false;
+}
+bool Pix::StepBands(int rows, int band_rows, int max_bands, 
+  const std::function<void(int,int,int)>& body) {
+  int bands = (rows + band_rows - 1)/band_rows;
+  if(step_band_ >= bands)
+    return false;
+  int last = max_bands > 0 ? std::min(bands, step_band_ + max_bands) : bands;
+  ForBandRange(rows, band_rows, step_band_, last, body);
+  step_band_ = last;
+  return true;
+}
+void Pix::FinishIteration(float palette_error) {
+  palette_error_ = palette_error;
+  AnnealingState state;
+  state.iteration = GetCurrentState()->iteration+1;
+  state.temperature = temperature_;
+  state.palette_error = palette_error;
+  if(schedule_->AtEquilibrium(state)) {
+    float final_temperature = schedule_->final_temperature();
+    if(temperature_ <= final_temperature) {
       converged_flag_ = true;
-    else
-      temperature_ = std::max(temperature_*kDT,kTF);
+      convergence_ = kConvergedPaletteError;
+    } else {
+      if(schedule_->uses_critical_temperatures())
+        state.critical_temperatures = GetCriticalTemperatures();
+      temperature_ = std::max(schedule_->Cool(state),final_temperature);
+    }
 
     ExpandPalette();
+  } else if(temperature_ <= schedule_->final_temperature()) {
+    convergence_ = CheckStall(palette_error);
+    converged_flag_ = convergence_ != kNotConverged;
+  }
+  //the criteria only count iterations at the final temperature
+  if(temperature_ > schedule_->final_temperature() || converged_flag_) {
+    stall_iterations_ = 0;
+    error_window_.clear();
   }
 
 
   GetCurrentState()->iteration++;
+  PublishResult();
+}
+PixConvergence Pix::CheckStall(float palette_error) {
+  const ConvergenceCriteria& criteria = convergence_criteria_;
+  bool churn = criteria.max_churn >= 0;
+  bool movement = criteria.max_movement >= 0;
+  if(churn || movement) {
+    if((!churn || assignment_churn_ <= criteria.max_churn) && 
+      (!movement || superpixel_movement_ <= criteria.max_movement))
+      stall_iterations_++;
+    else
+      stall_iterations_ = 0;
+    if(stall_iterations_ >= std::max(1, criteria.patience))
+      return kConvergedStalled;
+  }
+  if(criteria.error_window > 0 && criteria.window_tolerance >= 0) {
+    error_window_.push_back(palette_error);
+    if(error_window_.size() > criteria.error_window)
+      error_window_.pop_front();
+    if(error_window_.size() == criteria.error_window) {
+      float low = *std::min_element(error_window_.begin(), error_window_.end());
+      float high = *std::max_element(error_window_.begin(), error_window_.end());
+      if(high - low < criteria.window_tolerance)
+        return kConvergedErrorWindow;
+    }
+  }
+  return kNotConverged;
+}
+const char * PixConvergenceName(PixConvergence convergence) {
+  switch(convergence) {
+  case kConvergedPaletteError: return "palette error";
+  case kConvergedStalled: return "stalled";
+  case kConvergedErrorWindow: return "error window";
+  default: return "not converged";
+  }
 }
 void Pix::AssociatePalette() {
+  ResetStep();
+  BeginPaletteAssociation();
+  ForEachBand(palette_rows(), palette_band_rows(), [this](int band, int begin, int end) {
+    AssociatePaletteRows(band, begin, end);
+  });
+  FinishPaletteAssociation();
+}
+void Pix::BeginPaletteAssociation() {
+  BinSuperpixelColors();
   int current_palette_size = GetCurrentState()->palette.size();
-  //used to store updated prob(index)
-  std::vector<float> new_prob_c(current_palette_size, 0.0);
+  //used to store updated prob(index), per band and summed up in band order
+  int bands = (palette_rows() + palette_band_rows() - 1)/palette_band_rows();
+  band_prob_c_ = std::vector<std::vector<float> >(bands, 
+    std::vector<float>(current_palette_size, 0.0));
   //we will recalculate prob(index|p_s)
-  prob_co_ = std::vector<std::vector<float> >(current_palette_size, 
-    std::vector<float>(output_width_*output_height_, 0.0));
-  double overT = -1.0f/temperature_;
+  sparse_width_ = std::min(sparse_max_colors_, current_palette_size);
+  //a large palette is indexed for the sparse association, which only
+  //needs the colors close to a superpixel. The index is rebuilt when the
+  //palette changed.
+  palette_indexed_ = sparse_width_ > 0 && 
+    current_palette_size >= kPaletteIndexColors;
+  if(palette_indexed_) {
+    if(!palette_index_.Indexes(GetCurrentState()->palette))
+      palette_index_.Build(GetCurrentState()->palette);
+    max_prob_c_ = *std::max_element(GetCurrentState()->prob_c.begin(), 
+      GetCurrentState()->prob_c.end());
+  }
+  if(sparse_width_ > 0) {
+    prob_co_.clear();
+    sparse_colors_.assign(palette_samples()*sparse_width_, 0);
+    sparse_probs_.assign(palette_samples()*sparse_width_, 0.0f);
+    sparse_counts_.assign(palette_samples(), 0);
+  } else {
+    prob_co_ = std::vector<std::vector<float> >(current_palette_size, 
+      std::vector<float>(palette_samples(), 0.0));
+    sparse_colors_.clear();
+    sparse_probs_.clear();
+    sparse_counts_.clear();
+  }
+  band_churn_ = std::vector<int>(bands, 0);
+}
+void Pix::AssociatePaletteRows(int band, int begin, int end) {
+  std::vector<float>& new_prob_c = band_prob_c_[band];
+  if(binned_association_) {
+    //the superpixels take the color of their bin once all bins are done
+    const std::list<int> unconstrained;
+    for(int bin = begin; bin<end; ++bin) {
+      int superpixel = bin_constrained_[bin];
+      bin_assign_[bin] = AssociateColor(bin_colors_[bin], superpixel < 0 ? 
+        unconstrained : GetCurrentState()->pixel_constraints[superpixel], 
+        bin_weights_[bin], bin, new_prob_c);
+    }
+    return;
+  }
 
   //associate SPs with colors in the palette
   //assign to each SP the color with the highest probability
+  for(int y = begin; y<end; ++y) {
+    for(int x = 0; x<output_width_; ++x) {
+      int index = vec2idx(cv::Vec2i(x,y));
+      int best_index = AssociateColor(
+        GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x), 
+        GetCurrentState()->pixel_constraints[index], 
+        superpixel_weights_.at<float>(y,x), index, new_prob_c);
+      if(GetCurrentState()->palette_assign.at<int>(y,x) != best_index)
+        band_churn_[band]++;
+      GetCurrentState()->palette_assign.at<int>(y,x) = best_index;
+    }
+  }
+}
+int Pix::AssociateColor(const cv::Vec3f& color, 
+  const std::list<int>& constraints, double weight, int sample, 
+  std::vector<float>& new_prob_c) {
+  int current_palette_size = GetCurrentState()->palette.size();
+  double overT = -1.0f/temperature_;
+  int best_index = -1;
+  double best_error;
+  std::vector<double> probs;
+  double sum_prob = 0;
+
+  //if there are no constraints, list all colors as possible constraints,
+  //or those that can matter if the palette is indexed
+  std::list<int> candidates = constraints;
+  if(candidates.size() == 0 && !ListLikelyColors(color, candidates)) {
+    for(int i = 0; i< current_palette_size; ++i) {
+      candidates.push_back(i);
+    }
+  }
+
+  for(std::list<int>::iterator nCol = candidates.begin(); nCol != candidates.end(); ++nCol) {				
+    int index = *nCol;
+    double color_error = norm(GetCurrentState()->palette[index], color);
+    double prob = GetCurrentState()->prob_c[index]*exp(color_error*overT);
+    probs.push_back(prob);
+    sum_prob += prob;
+    if(best_index == -1 || color_error < best_error) {
+      best_index = index;
+      best_error = color_error;
+    }
+  }
+
+  if(sparse_width_ > 0) {
+    //keep the most probable colors above the epsilon, at least one
+    std::vector<std::pair<double,int> > ranked;
+    int constraints_index = 0;
+    for(std::list<int>::iterator nCol = candidates.begin(); nCol != candidates.end(); ++nCol) {
+      ranked.push_back(std::make_pair(probs[constraints_index], *nCol));
+      constraints_index++;
+    }
+    int keep = std::min(sparse_width_, (int)ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(), 
+      std::greater<std::pair<double,int> >());
+    int count = 0;
+    double kept_prob = 0;
+    while(count < keep && 
+      (count == 0 || ranked[count].first >= sparse_epsilon_*sum_prob)) {
+        kept_prob += ranked[count].first;
+        count++;
+    }
+    int first = sample*sparse_width_;
+    for(int i = 0; i<count; ++i) {
+      double normalized_prob = ranked[i].first/kept_prob;
+      sparse_colors_[first + i] = ranked[i].second;
+      sparse_probs_[first + i] = normalized_prob;
+      new_prob_c[ranked[i].second] += weight*normalized_prob;
+    }
+    sparse_counts_[sample] = count;
+    return best_index;
+  }
+
+  int constraints_index = 0;
+  for(std::list<int>::iterator nCol = candidates.begin(); nCol != candidates.end(); ++nCol) {
+    int color_index = *nCol;
+    double normalized_prob = probs.at(constraints_index)/sum_prob;
+    prob_co_[color_index][sample] = normalized_prob;
+    new_prob_c[color_index] += weight*normalized_prob;
+    constraints_index++;
+  }
+  return best_index;
+}
+bool Pix::ListLikelyColors(const cv::Vec3f& color, 
+  std::list<int>& candidates) {
+  if(!palette_indexed_ || sparse_epsilon_ <= 0)
+    return false;
+  double distance;
+  int nearest = palette_index_.Nearest(color, distance);
+  float prob_nearest = GetCurrentState()->prob_c[nearest];
+  if(prob_nearest <= 0)
+    return false;
+
+  //prob(c) times exp(-distance/T) of a color further away than radius is
+  //below epsilon times that of the nearest color, so the sparse 
+  //association would drop it
+  double radius = distance + 
+    temperature_*log(max_prob_c_/(sparse_epsilon_*prob_nearest));
+  std::vector<int> indices;
+  palette_index_.WithinRadius(color, radius, indices);
+  candidates.assign(indices.begin(), indices.end());
+  return true;
+}
+float Pix::AssociationProbability(int color, int sample) const {
+  if(sparse_width_ == 0)
+    return prob_co_[color][sample];
+  int first = sample*sparse_width_;
+  for(int i = 0; i<sparse_counts_[sample]; ++i) {
+    if(sparse_colors_[first + i] == color)
+      return sparse_probs_[first + i];
+  }
+  return 0;
+}
+void Pix::SumAssociatedColors(int sample, const cv::Vec3d& color, 
+  float weight, std::vector<cv::Vec3d>& sums) const {
+  if(sparse_width_ == 0) {
+    for(int c = 0; c<prob_co_.size(); ++c) {
+      double w = weight*prob_co_[c][sample];
+      sums[c] += color*w;
+    }
+    return;
+  }
+  int first = sample*sparse_width_;
+  for(int i = 0; i<sparse_counts_[sample]; ++i) {
+    double w = weight*sparse_probs_[first + i];
+    sums[sparse_colors_[first + i]] += color*w;
+  }
+}
+void Pix::BinSuperpixelColors() {
+  binned_association_ = binned_palette_;
+  bin_colors_.clear();
+  bin_weights_.clear();
+  bin_counts_.clear();
+  bin_constrained_.clear();
+  superpixel_bins_.clear();
+  if(!binned_association_) {
+    bin_assign_.clear();
+    return;
+  }
+
+  //bins are numbered in the order of their first superpixel, which keeps
+  //the bands, and so the sums, the same on every run
+  std::unordered_map<long long,int> bin_index;
+  std::vector<cv::Vec3d> weighted_sums, sums;
+  std::vector<double> weights;
+  superpixel_bins_.resize(output_width_*output_height_);
   for(int y = 0; y<output_height_; ++y) {
     for(int x = 0; x<output_width_; ++x) {
-      //for each SP: 
-      int best_index = -1;
-      double best_error;
-      std::vector<double> probs;
-      cv::Vec3f pixel = GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
-      double sum_prob = 0;
-
-      //get current SP pixel constraints
-      std::list<int> constraints = 
-        GetCurrentState()->pixel_constraints[vec2idx(cv::Vec2i(x,y))];
-      //if there are no constraints, list all colors as possible constraints
-      if(constraints.size() == 0) {
-        for(int i = 0; i< current_palette_size; ++i) {
-          constraints.push_back(i);
+      int index = vec2idx(cv::Vec2i(x,y));
+      cv::Vec3f color = GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
+      bool constrained = !GetCurrentState()->pixel_constraints[index].empty();
+      int bin = bin_colors_.size();
+      if(!constrained) {
+        long long key = 0;
+        for(int c = 0; c<3; ++c) {
+          key = (key << 16) + (1 << 15) + (int)floor(color[c]/kPaletteBinSize);
         }
+        std::unordered_map<long long,int>::iterator it = bin_index.find(key);
+        if(it != bin_index.end())
+          bin = it->second;
+        else
+          bin_index[key] = bin;
       }
-
-      for(std::list<int>::iterator nCol = constraints.begin(); nCol != constraints.end(); ++nCol) {				
-        int index = *nCol;
-        double color_error = norm(GetCurrentState()->palette[index], pixel);
-        double prob = GetCurrentState()->prob_c[index]*exp(color_error*overT);
-        probs.push_back(prob);
-        sum_prob += prob;
-        if(best_index == -1 || color_error < best_error) {
-          best_index = index;
-          best_error = color_error;
-        }
+      if(bin == bin_colors_.size()) {
+        bin_colors_.push_back(color);
+        bin_counts_.push_back(0);
+        bin_constrained_.push_back(constrained ? index : -1);
+        weighted_sums.push_back(cv::Vec3d(0.0,0.0,0.0));
+        sums.push_back(cv::Vec3d(0.0,0.0,0.0));
+        weights.push_back(0);
       }
-      //assign current SP the color with the highest probability
-      GetCurrentState()->palette_assign.at<int>(y,x) = best_index;
+      superpixel_bins_[index] = bin;
+      double weight = superpixel_weights_.at<float>(y,x);
+      bin_counts_[bin]++;
+      weights[bin] += weight;
+      weighted_sums[bin] += cv::Vec3d(color)*weight;
+      sums[bin] += cv::Vec3d(color);
+    }
+  }
 
-      double prob_sp = superpixel_weights_.at<float>(y,x);
-      int constraints_index = 0;
-      for(std::list<int>::iterator nCol = constraints.begin(); nCol != constraints.end(); ++nCol) {
-        int color_index = *nCol;
-        double normalized_prob = probs.at(constraints_index)/sum_prob;
-        prob_co_[color_index][vec2idx(cv::Vec2i(x,y))] = normalized_prob;
-        new_prob_c[color_index] += prob_sp*normalized_prob;
-        constraints_index++;
-      }
+  //the weighted mean keeps the color sums of the refinement, bins of 
+  //superpixels without weight take the plain mean
+  bin_weights_.resize(bin_colors_.size());
+  for(int bin = 0; bin<bin_colors_.size(); ++bin) {
+    bin_weights_[bin] = weights[bin];
+    if(weights[bin] > 0)
+      bin_colors_[bin] = weighted_sums[bin]*(1.0/weights[bin]);
+    else
+      bin_colors_[bin] = sums[bin]*(1.0/bin_counts_[bin]);
+  }
+  bin_assign_.assign(bin_colors_.size(), 0);
+}
+void Pix::FinishPaletteAssociation() {
+  int current_palette_size = GetCurrentState()->palette.size();
+  std::vector<float> new_prob_c(current_palette_size, 0.0);
+  for(int band = 0; band<band_prob_c_.size(); ++band) {
+    for(int i = 0; i<current_palette_size; ++i) {
+      new_prob_c[i] += band_prob_c_[band][i];
     }
   }
   GetCurrentState()->prob_c = new_prob_c;
+  int changed = 0;
+  if(binned_association_) {
+    for(int y = 0; y<output_height_; ++y) {
+      for(int x = 0; x<output_width_; ++x) {
+        int best_index = bin_assign_[superpixel_bins_[vec2idx(cv::Vec2i(x,y))]];
+        if(GetCurrentState()->palette_assign.at<int>(y,x) != best_index)
+          changed++;
+        GetCurrentState()->palette_assign.at<int>(y,x) = best_index;
+      }
+    }
+  }
+  for(int band = 0; band<band_churn_.size(); ++band) {
+    changed += band_churn_[band];
+  }
+  assignment_churn_ = changed/(float)(output_width_*output_height_);
 }
 std::vector<cv::Vec3f> Pix::GetPalette() {
   std::vector<cv::Vec3f> effective_palette;
@@ -422,54 +1054,223 @@ std::vector<cv::Vec3f> Pix::GetPalette() {
   return rgbPal;
 }	
 void Pix::GetOutputImage(cv::Mat& img) {
-  cv::Mat lab(cv::Size(output_width_,output_height_), CV_32FC3);
-  std::vector<cv::Vec3f> averaged_palette = GetAveragedPalette();
-  for(int i = 0; i<averaged_palette.size();++i) {
-    averaged_palette[i][1] *= GetCurrentState()->saturation;
-    averaged_palette[i][2] *= GetCurrentState()->saturation;
+  PixOutputs outputs;
+  outputs.output = &img;
+  RenderOutputs(outputs);
+}
+void Pix::GetRegionImage(cv::Mat& img) {
+  PixOutputs outputs;
+  outputs.region = &img;
+  RenderOutputs(outputs);
+}
+
+int Pix::ForEachBand(int rows, int band_rows, 
+  const std::function<void(int,int,int)>& body) {
+  int bands = (rows + band_rows - 1)/band_rows;
+  ForBandRange(rows, band_rows, 0, bands, body);
+  return bands;
+}
+void Pix::ForBandRange(int rows, int band_rows, int first, int last, 
+  const std::function<void(int,int,int)>& body) {
+  executor_->ParallelFor(last - first, [&](int i) {
+    int begin = (first + i)*band_rows;
+    body(first + i, begin, std::min(rows, begin + band_rows));
+  });
+}
+
+void Pix::RenderOutputs(const PixOutputs& outputs) {
+  cv::Size output_size(output_width_, output_height_);
+  if(outputs.output)
+    outputs.output->create(output_size, CV_8UC3);
+  if(outputs.upscaled)
+    outputs.upscaled->create(cv::Size(output_width_*outputs.upscale_factor, 
+      output_height_*outputs.upscale_factor), CV_8UC3);
+  if(outputs.superpixel)
+    outputs.superpixel->create(output_size, CV_8UC3);
+  if(outputs.region)
+    outputs.region->create(cv::Size(input_width_, input_height_), CV_8UC3);
+
+  //the output image only ever takes palette values, so convert each palette
+  //entry once instead of converting every output pixel
+  std::vector<cv::Vec3b> palette_rgb;
+  if(outputs.output || outputs.upscaled) {
+    palette_rgb = PaletteToRgb(GetAveragedPalette(), 
+      GetCurrentState()->saturation);
   }
 
-  for(int y = 0; y<output_height_; ++y) {
-    for(int x = 0; x<output_width_; ++x) {
-      lab.at<cv::Vec3f>(y,x) = 
-        averaged_palette[GetCurrentState()->palette_assign.at<int>(y,x)];
+  ForEachBand(output_height_, kOutputBandRows, [&](int, int begin, int end) {
+    RenderOutputRows(outputs, palette_rgb, begin, end);
+  });
+}
+void Pix::RenderOutputRows(const PixOutputs& outputs, 
+  const std::vector<cv::Vec3b>& palette_rgb, int begin, int end) {
+  RenderPaletteRows(GetCurrentState()->palette_assign, palette_rgb, outputs, 
+    begin, end);
+
+  for(int y = begin; y < end; ++y) {
+    if(outputs.superpixel) {
+      cv::Mat rgb;
+      cv::cvtColor(GetCurrentState()->superpixel_color.row(y), rgb, 
+        CV_Lab2RGB);
+      cv::Mat dst = outputs.superpixel->row(y);
+      rgb.convertTo(dst, CV_8UC3, 255.0);
+    }
+
+    if(outputs.region) {
+      //the band of input rows that corresponds to this output row
+      int input_begin = y*input_height_/output_height_;
+      int input_end = (y+1)*input_height_/output_height_;
+      for(int yy = input_begin; yy < input_end; ++yy) {
+        cv::Mat rgb;
+        cv::cvtColor(input_img_.row(yy), rgb, CV_Lab2RGB);
+        cv::Mat dst = outputs.region->row(yy);
+        rgb.convertTo(dst, CV_8UC3, 255.0);
+        for(int x = 0; x<input_width_; ++x) {
+          cv::Vec2i cluster = region_map_.at<cv::Vec2i>(yy,x);
+          if(x+1 < region_map_.cols) {
+            cv::Vec2i c2 = region_map_.at<cv::Vec2i>(yy,x+1);
+            if (c2[0] != cluster[0] || c2[1] != cluster[1]) {
+              dst.at<cv::Vec3b>(0,x) = cv::Vec3b(0,0,255);
+            }
+          }
+          if(yy+1 < region_map_.rows) {
+            cv::Vec2i c2 = region_map_.at<cv::Vec2i>(yy+1,x);
+            if (c2[0] != cluster[0] || c2[1] != cluster[1]) {
+              dst.at<cv::Vec3b>(0,x) = cv::Vec3b(0,0,255);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void Pix::GetResult(PixResult& result) {
+  GetCurrentState()->palette_assign.copyTo(result.palette_assign);
+  result.palette = GetAveragedPalette();
+  result.saturation = GetCurrentState()->saturation;
+  result.iterations = GetCurrentState()->iteration;
+}
+PixResultPtr Pix::GetPublishedResult() const {
+  return std::atomic_load(&published_result_);
+}
+void Pix::PublishResult() {
+  std::shared_ptr<PixResult> result(new PixResult());
+  GetResult(*result);
+  std::atomic_store(&published_result_, PixResultPtr(result));
+}
+std::vector<cv::Vec3b> Pix::GetResultPalette(const PixResult& result) {
+  return PaletteToRgb(result.palette, result.saturation);
+}
+float Pix::GetColorError() {
+  std::vector<cv::Vec3f> averaged_palette = GetAveragedPalette();
+  const cv::Mat& palette_assign = GetCurrentState()->palette_assign;
+  int bands = (input_height_ + kInputBandRows - 1)/kInputBandRows;
+  std::vector<double> band_error(bands, 0.0), band_weight(bands, 0.0);
+  ForEachBand(input_height_, kInputBandRows, [&](int band, int begin, int end) {
+    for(int y = begin; y<end; ++y) {
+      for(int x = 0; x<input_width_; ++x) {
+        cv::Vec2i superpixel = region_map_.at<cv::Vec2i>(y,x);
+        if(superpixel[0] < 0)
+          continue;
+        cv::Vec3f color = averaged_palette[
+          palette_assign.at<int>(superpixel[1], superpixel[0])];
+        float weight = input_weights_.at<float>(y,x);
+        band_error[band] += weight*cv::norm(input_img_.at<cv::Vec3f>(y,x) - color);
+        band_weight[band] += weight;
+      }
     }
+  });
+  double error = 0, total_weight = 0;
+  for(int band = 0; band<bands; ++band) {
+    error += band_error[band];
+    total_weight += band_weight[band];
   }
-  cv::Mat rgb; 
+  return total_weight > 0 ? error/total_weight : 0.0f;
+}
+void Pix::RenderResult(const PixResult& result, const PixOutputs& outputs) {
+  int width = result.palette_assign.cols;
+  int height = result.palette_assign.rows;
+  if(outputs.output)
+    outputs.output->create(cv::Size(width, height), CV_8UC3);
+  if(outputs.upscaled)
+    outputs.upscaled->create(cv::Size(width*outputs.upscale_factor, 
+      height*outputs.upscale_factor), CV_8UC3);
+  if(!outputs.output && !outputs.upscaled)
+    return;
+  RenderPaletteRows(result.palette_assign, 
+    PaletteToRgb(result.palette, result.saturation), outputs, 0, height);
+}
+std::vector<cv::Vec3b> Pix::PaletteToRgb(const std::vector<cv::Vec3f>& palette,
+  float saturation) {
+  InitColorTables();
+  std::vector<cv::Vec3b> palette_rgb;
+  if(palette.empty())
+    return palette_rgb;
+  cv::Mat lab(cv::Size(palette.size(), 1), CV_32FC3);
+  for(int i = 0; i<palette.size();++i) {
+    cv::Vec3f color = palette[i];
+    color[1] *= saturation;
+    color[2] *= saturation;
+    lab.at<cv::Vec3f>(0,i) = color;
+  }
+  cv::Mat rgb, rgb8;
   cv::cvtColor(lab, rgb, CV_Lab2RGB);
-  rgb.convertTo(img, CV_8UC3, 255.0);
+  rgb.convertTo(rgb8, CV_8UC3, 255.0);
+  for(int i = 0; i<palette.size();++i) {
+    palette_rgb.push_back(rgb8.at<cv::Vec3b>(0,i));
+  }
+  return palette_rgb;
 }
-void Pix::GetRegionImage(cv::Mat& img) {
-  cv::Mat temp;
-  cvtColor(input_img_, temp, CV_Lab2RGB);
-  temp.convertTo(img, CV_8UC3, 255.0);
-  for(int y = 0; y< input_height_; ++y) {
-    for(int x = 0; x<input_width_; ++x) {
-      cv::Vec2i cluster = region_map_.at<cv::Vec2i>(y,x);
-      if(x+1 < region_map_.cols) {
-        cv::Vec2i c2 = region_map_.at<cv::Vec2i>(y,x+1);
-        if (c2[0] != cluster[0] || c2[1] != cluster[1]) {
-          img.at<cv::Vec3b>(y,x) = cv::Vec3b(0,0,255);
+void Pix::RenderPaletteRows(const cv::Mat& palette_assign, 
+  const std::vector<cv::Vec3b>& palette_rgb, const PixOutputs& outputs, 
+  int begin, int end) {
+  if(!outputs.output && !outputs.upscaled)
+    return;
+  int factor = outputs.upscale_factor;
+  for(int y = begin; y < end; ++y) {
+    for(int x = 0; x<palette_assign.cols; ++x) {
+      cv::Vec3b color = palette_rgb[palette_assign.at<int>(y,x)];
+      if(outputs.output)
+        outputs.output->at<cv::Vec3b>(y,x) = color;
+      if(outputs.upscaled) {
+        cv::Vec3b * big_row = outputs.upscaled->ptr<cv::Vec3b>(y*factor);
+        for(int i = 0; i<factor; ++i) {
+          big_row[x*factor + i] = color;
         }
       }
-      if(y+1 < region_map_.rows) {
-        cv::Vec2i c2 = region_map_.at<cv::Vec2i>(y+1,x);
-        if (c2[0] != cluster[0] || c2[1] != cluster[1]) {
-          img.at<cv::Vec3b>(y,x) = cv::Vec3b(0,0,255);
-        }
+    }
+    //replicate the first upscaled row instead of recomputing it
+    if(outputs.upscaled) {
+      cv::Mat first_row = outputs.upscaled->row(y*factor);
+      for(int i = 1; i<factor; ++i) {
+        cv::Mat next_row = outputs.upscaled->row(y*factor + i);
+        first_row.copyTo(next_row);
       }
     }
   }
 }
 
 void Pix::UpdateSuperpixelMapping() {
+  ResetStep();
+  BeginSuperpixelMapping();
+  ForEachBand(input_height_, kInputBandRows, [this](int, int begin, int end) {
+    MapSuperpixelRows(begin, end);
+  });
+  FinishSuperpixelMapping();
+}
+void Pix::BeginSuperpixelMapping() {
   region_map_ = 
     cv::Mat(cv::Size(input_width_, input_height_),CV_32SC2,cv::Scalar(-1.0));
-  cv::vector<cv::Vec3f> averaged_palette = GetAveragedPalette();
-
-  //for each superpixel, update all pixels in a 2sx2s region
-  cv::Mat distance = 
+  mapping_palette_ = GetAveragedPalette();
+  mapping_distance_ = 
     cv::Mat(cv::Size(input_width_, input_height_), CV_32FC1, cv::Scalar(-5.0f));
+}
+void Pix::MapSuperpixelRows(int begin, int end) {
+  //for each superpixel, update all pixels in a 2sx2s region. Each band of
+  //input rows visits the superpixels reaching into it in the same order, so
+  //the mapping does not depend on how the bands are scheduled.
+  cv::Mat& distance = mapping_distance_;
   for(int y = 0; y<output_height_; ++y) {
     for(int x = 0; x<output_width_; ++x) {
       cv::Vec2f pos = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(y,x);
@@ -477,10 +1278,12 @@ void Pix::UpdateSuperpixelMapping() {
       int min_y = std::max(0.0f,pos[1]-range_);
       int max_x = std::min<int>(input_width_-1,(int)(pos[0]+range_));
       int max_y = std::min<int>(input_height_-1,(int)(pos[1]+range_));
+      min_y = std::max(min_y, begin);
+      max_y = std::min(max_y, end-1);
+      if(min_y > max_y)
+        continue;
       cv::Vec3f superpixel_color = 
-        averaged_palette[GetCurrentState()->palette_assign.at<int>(y,x)];
-
-      int idx = vec2idx(cv::Vec2i(x,y));
+        mapping_palette_[GetCurrentState()->palette_assign.at<int>(y,x)];
 
       for(int yy = min_y; yy<= max_y; ++yy) {
         for(int xx = min_x; xx<=max_x; ++xx) {
@@ -497,49 +1300,73 @@ void Pix::UpdateSuperpixelMapping() {
       }
     }
   }
-  //store input pixels in superpixel regions
-  region_list_ = 
-    std::vector<std::vector<cv::Vec2i> >(output_width_*output_height_);
-  for(int y = 0; y< input_height_; ++y) {
+  //pixels out of reach of every superpixel go to the superpixel of their
+  //grid cell
+  for(int y = begin; y<end; ++y) {
     for(int x = 0; x<input_width_; ++x) {
-      cv::Vec2i superpixel = region_map_.at<cv::Vec2i>(y,x);
-      int index = vec2idx(superpixel);
-
-      if(index == -1) {
+      if(region_map_.at<cv::Vec2i>(y,x)[0] < 0) {
         int i = (int) ( x/(float)input_width_*output_width_);
         int j = (int) ( y/(float)input_height_*output_height_ );
         region_map_.at<cv::Vec2i>(y,x) = cv::Vec2i(i,j);
-        index = vec2idx(cv::Vec2i(i,j));
       }
-      region_list_[index].push_back(cv::Vec2i(x,y));
+    }
+  }
+}
+void Pix::FinishSuperpixelMapping() {
+  //store input pixels in superpixel regions
+  region_list_ = 
+    std::vector<std::vector<cv::Vec2i> >(output_width_*output_height_);
+  for(int y = 0; y< input_height_; ++y) {
+    for(int x = 0; x<input_width_; ++x) {
+      region_list_[vec2idx(region_map_.at<cv::Vec2i>(y,x))].push_back(
+        cv::Vec2i(x,y));
     }
   }
 }
 void Pix::UpdateSuperpixelMeans() {
-  cv::Mat color_sums = 
+  ResetStep();
+  BeginSuperpixelMeans();
+  ForEachBand(output_height_, kOutputBandRows, [this](int, int begin, int end) {
+    SumSuperpixelRows(begin, end);
+  });
+  FinishSuperpixelMeans();
+}
+void Pix::BeginSuperpixelMeans() {
+  means_color_sums_ = 
     cv::Mat(cv::Size(output_width_, output_height_),CV_32FC3,cv::Scalar(0.0f));
-  cv::Mat pos_sums = 
+  means_pos_sums_ = 
     cv::Mat(cv::Size(output_width_, output_height_),CV_32FC2,cv::Scalar(0.0f));
-  cv::Mat weights = 
+  means_counts_ = 
     cv::Mat(cv::Size(output_width_, output_height_),CV_32FC1,cv::Scalar(0.0f));
 
 
   superpixel_weights_ = 
     cv::Mat(cv::Size(output_width_, output_height_),CV_32FC1, cv::Scalar(0.0f));
-  //total them up
-  for(int y = 0; y < input_height_; ++y) {
-    for(int x = 0; x < input_width_; ++x) {
-      cv::Vec2i superpixel = region_map_.at<cv::Vec2i>(y,x);
-      cv::Vec3f pixel_color = input_img_.at<cv::Vec3f>(y,x);
-      color_sums.at<cv::Vec3f>(superpixel[1],superpixel[0]) += pixel_color;
-      pos_sums.at<cv::Vec2f>(superpixel[1],superpixel[0]) += 
-        cv::Vec2f((float) x,(float) y);
-      weights.at<float>(superpixel[1],superpixel[0]) += 1.0f;
-      superpixel_weights_.at<float>(superpixel[1],superpixel[0]) += 
-        input_weights_.at<float>(y,x);
-
+  means_old_pos_ = GetCurrentState()->superpixel_pos.clone();
+}
+void Pix::SumSuperpixelRows(int begin, int end) {
+  cv::Mat& color_sums = means_color_sums_;
+  cv::Mat& pos_sums = means_pos_sums_;
+  cv::Mat& weights = means_counts_;
+  //total them up. region_list_ holds each superpixel's pixels in row major
+  //order, so the sums are independent of the bands.
+  for(int y = begin; y < end; ++y) {
+    for(int x = 0; x < output_width_; ++x) {
+      const std::vector<cv::Vec2i>& pixels = region_list_[vec2idx(cv::Vec2i(x,y))];
+      for(int i = 0; i<pixels.size(); ++i) {
+        int xx = pixels[i][0], yy = pixels[i][1];
+        color_sums.at<cv::Vec3f>(y,x) += input_img_.at<cv::Vec3f>(yy,xx);
+        pos_sums.at<cv::Vec2f>(y,x) += cv::Vec2f((float) xx,(float) yy);
+        weights.at<float>(y,x) += 1.0f;
+        superpixel_weights_.at<float>(y,x) += input_weights_.at<float>(yy,xx);
+      }
     }
   }
+}
+void Pix::FinishSuperpixelMeans() {
+  cv::Mat& color_sums = means_color_sums_;
+  cv::Mat& pos_sums = means_pos_sums_;
+  cv::Mat& weights = means_counts_;
   //find the average
   int total_weight = 0;
   for(int y = 0; y<color_sums.rows; ++y) {
@@ -569,135 +1396,186 @@ void Pix::UpdateSuperpixelMeans() {
 
   SmoothSuperpixelPositions();
   SmoothSuperpixelColors();	
+
+  double movement = 0;
+  for(int y = 0; y<output_height_; ++y) {
+    for(int x = 0; x<output_width_; ++x) {
+      movement += norm(GetCurrentState()->superpixel_pos.at<cv::Vec2f>(y,x) - 
+        means_old_pos_.at<cv::Vec2f>(y,x));
+    }
+  }
+  superpixel_movement_ = movement/(output_width_*output_height_);
 }
 void Pix::SmoothSuperpixelPositions() {
   cv::Mat new_superpixel_pos = cv::Mat(GetCurrentState()->superpixel_pos.size(), 
     GetCurrentState()->superpixel_pos.type());
-  for(int i = 0; i<output_width_; ++i) {
-    for(int j = 0; j<output_height_; ++j) {
-      cv::Vec2f sum(0,0);
-      float count = 0.0f;
-
-      //average neighboring vertices (avoid going out of image bounds)
-      if(i > 0) {
-        sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i-1);
-        count += 1.0f;
-      }
-      if(i< GetCurrentState()->superpixel_pos.cols -1) {
-        sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i+1);
-        count += 1.0f;
-      }
-      if(j > 0) {
-        sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j-1,i);
-        count += 1.0f;
-      }
-      if(j<GetCurrentState()->superpixel_pos.rows - 1) {
-        sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j+1,i);
-        count += 1.0f;
-      }
-      sum[0] /= count;
-      sum[1] /= count;
-
-      //Move the current superpixels position a percentage of the
-      //way to the centroid of it's neighbors. If it is missing a
-      //neighbor in the x or y direction, do not smooth in that
-      //direction
-      cv::Vec2f orig = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i);
-      cv::Vec2f nPos(0,0);
-      if(i == 0 || i == GetCurrentState()->superpixel_pos.cols -1) {
-        nPos[0] = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i)[0];
-      } else {
-        nPos[0] = (1.0f-smooth_pos_factor_)*orig[0] + smooth_pos_factor_*sum[0];
-      }
-      if(j == 0 || j == GetCurrentState()->superpixel_pos.rows - 1) {
-        nPos[1] = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i)[1];
-      } else {
-        nPos[1] = (1.0f-smooth_pos_factor_)*orig[1] + smooth_pos_factor_*sum[1];
+  ForEachBand(output_height_, kOutputBandRows, [&](int, int begin, int end) {
+    for(int j = begin; j<end; ++j) {
+      for(int i = 0; i<output_width_; ++i) {
+        cv::Vec2f sum(0,0);
+        float count = 0.0f;
+
+        //average neighboring vertices (avoid going out of image bounds)
+        if(i > 0) {
+          sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i-1);
+          count += 1.0f;
+        }
+        if(i< GetCurrentState()->superpixel_pos.cols -1) {
+          sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i+1);
+          count += 1.0f;
+        }
+        if(j > 0) {
+          sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j-1,i);
+          count += 1.0f;
+        }
+        if(j<GetCurrentState()->superpixel_pos.rows - 1) {
+          sum += GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j+1,i);
+          count += 1.0f;
+        }
+        sum[0] /= count;
+        sum[1] /= count;
+
+        //Move the current superpixels position a percentage of the
+        //way to the centroid of it's neighbors. If it is missing a
+        //neighbor in the x or y direction, do not smooth in that
+        //direction
+        cv::Vec2f orig = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i);
+        cv::Vec2f nPos(0,0);
+        if(i == 0 || i == GetCurrentState()->superpixel_pos.cols -1) {
+          nPos[0] = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i)[0];
+        } else {
+          nPos[0] = (1.0f-smooth_pos_factor_)*orig[0] + smooth_pos_factor_*sum[0];
+        }
+        if(j == 0 || j == GetCurrentState()->superpixel_pos.rows - 1) {
+          nPos[1] = GetCurrentState()->superpixel_pos.at<cv::Vec2f>(j,i)[1];
+        } else {
+          nPos[1] = (1.0f-smooth_pos_factor_)*orig[1] + smooth_pos_factor_*sum[1];
+        }
+        new_superpixel_pos.at<cv::Vec2f>(j,i) = nPos;
       }
-      new_superpixel_pos.at<cv::Vec2f>(j,i) = nPos;
     }
-  }
+  });
   //update the SP position matrix with the smoothed locations
   GetCurrentState()->superpixel_pos = new_superpixel_pos;
 }
 void Pix::SmoothSuperpixelColors() {
   cv::Mat new_superpixel_colors(GetCurrentState()->superpixel_color.size(), 
     GetCurrentState()->superpixel_color.type());
-  for(int i = 0; i<GetCurrentState()->superpixel_color.cols; ++i)
-  {
-    for(int j = 0; j<GetCurrentState()->superpixel_color.rows; ++j)
+  ForEachBand(output_height_, kOutputBandRows, [&](int, int begin, int end) {
+    for(int j = begin; j<end; ++j)
     {
+      for(int i = 0; i<GetCurrentState()->superpixel_color.cols; ++i)
+      {
 
-      //get bounds of 3x3 kernel (make sure we don't go off the image)
-      int min_x = std::max(0,i-1);
-      int max_x = std::min(output_width_-1,i+1);
-      int min_y = std::max(0,j-1);
-      int max_y = std::min(output_height_-1,j+1);
+        //get bounds of 3x3 kernel (make sure we don't go off the image)
+        int min_x = std::max(0,i-1);
+        int max_x = std::min(output_width_-1,i+1);
+        int min_y = std::max(0,j-1);
+        int max_y = std::min(output_height_-1,j+1);
 
-      //Initialize
-      cv::Vec3f sum(0,0,0);
-      float weight = 0;
+        //Initialize
+        cv::Vec3f sum(0,0,0);
+        float weight = 0;
 
-      //get current SP color and (grid) position
-      cv::Vec3f superpixel_color = 
-        GetCurrentState()->superpixel_color.at<cv::Vec3f>(j,i);
-      cv::Vec2f p((float) j, (float) i);
+        //get current SP color and (grid) position
+        cv::Vec3f superpixel_color = 
+          GetCurrentState()->superpixel_color.at<cv::Vec3f>(j,i);
+        cv::Vec2f p((float) j, (float) i);
 
-      //get bilaterally weighted average color of SP neighborhood
-      for(int ii = min_x; ii<= max_x; ++ii)
-      {
-        for(int jj = min_y; jj<=max_y; ++jj)
+        //get bilaterally weighted average color of SP neighborhood
+        for(int ii = min_x; ii<= max_x; ++ii)
         {
-
-          cv::Vec3f c_n = GetCurrentState()->superpixel_color.at<cv::Vec3f>(jj,ii);
-          float d_color = norm(superpixel_color,c_n);
-          float w_color = gaussian(d_color,sigma_color_,0.0f);
-          float d_pos = (float)norm(cv::Vec2i(i,j) - cv::Vec2i(ii,jj));
-          float w_pos = gaussian(d_pos, sigma_position_, 0.0f);
-          float w_total = w_color*w_pos;
-
-          weight += w_total;
-          sum += c_n*w_total;
+          for(int jj = min_y; jj<=max_y; ++jj)
+          {
+
+            cv::Vec3f c_n = GetCurrentState()->superpixel_color.at<cv::Vec3f>(jj,ii);
+            float d_color = norm(superpixel_color,c_n);
+            float w_color = gaussian(d_color,sigma_color_,0.0f);
+            float d_pos = (float)norm(cv::Vec2i(i,j) - cv::Vec2i(ii,jj));
+            float w_pos = gaussian(d_pos, sigma_position_, 0.0f);
+            float w_total = w_color*w_pos;
+
+            weight += w_total;
+            sum += c_n*w_total;
+          }
         }
+        sum *= 1.0/weight;
+        new_superpixel_colors.at<cv::Vec3f>(j,i) = sum;
       }
-      sum *= 1.0/weight;
-      new_superpixel_colors.at<cv::Vec3f>(j,i) = sum;
     }
-  }
+  });
   //update the SP mean colors with the smoothed values
   GetCurrentState()->superpixel_color = new_superpixel_colors;
 }
-float Pix::RefinePalette() {
+void Pix::BeginPaletteRefinement() {
   int current_palette_size = GetCurrentState()->palette.size();
-  //used to store weighted averages of SP for refinement step
-  std::vector<cv::Vec3d> color_sums(current_palette_size, cv::Vec3d(0.0,0.0,0.0)); 
-
+  //used to store weighted averages of SP for refinement step, per band and
+  //summed up in band order
+  int bands = (palette_rows() + palette_band_rows() - 1)/palette_band_rows();
+  band_color_sums_ = std::vector<std::vector<cv::Vec3d> >(bands, 
+    std::vector<cv::Vec3d>(current_palette_size, cv::Vec3d(0.0,0.0,0.0)));
+}
+void Pix::SumPaletteRows(int band, int begin, int end) {
   //take a weighted average of all superpixels, based on their probability of
   //association
-  for(int y = 0; y<output_height_; ++y) {
+  std::vector<cv::Vec3d>& sums = band_color_sums_[band];
+  if(binned_association_) {
+    for(int bin = begin; bin<end; ++bin) {
+      SumAssociatedColors(bin, bin_colors_[bin], bin_weights_[bin], sums);
+    }
+    return;
+  }
+  for(int y = begin; y<end; ++y) {
     for(int x = 0; x<output_width_; ++x) {
       float prob_sp = superpixel_weights_.at<float>(y,x);
       cv::Vec3d pixel_color = 
         GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
-      for(int c = 0; c<GetCurrentState()->palette.size(); ++c) {
-        double w = prob_sp*prob_co_[c][vec2idx(cv::Vec2i(x,y))];
-        color_sums.at(c) += pixel_color*w;
-      }
+      SumAssociatedColors(vec2idx(cv::Vec2i(x,y)), pixel_color, prob_sp, sums);
+    }
+  }
+}
+float Pix::FinishPaletteRefinement() {
+  int current_palette_size = GetCurrentState()->palette.size();
+  std::vector<cv::Vec3d> color_sums(current_palette_size, cv::Vec3d(0.0,0.0,0.0)); 
+  for(int band = 0; band<band_color_sums_.size(); ++band) {
+    for(int c = 0; c<current_palette_size; ++c) {
+      color_sums[c] += band_color_sums_[band][c];
     }
   }
 
-  //update the palette colors
+  //find the updated palette colors
   float palette_error = 0;
+  std::vector<cv::Vec3d> new_colors(current_palette_size);
   for(int i = 0; i< color_sums.size();++i) {
     //if the color is not locked and prob(c) > 0, update it
     cv::Vec3d color = GetCurrentState()->palette[i];
+    new_colors[i] = color;
     if(!(GetCurrentState()->locked_colors[i]) && 
       GetCurrentState()->prob_c[i] > 0) {
-        cv::Vec3d new_color = color_sums[i] * (1.0/GetCurrentState()->prob_c[i]);
-        GetCurrentState()->palette[i] = new_color;
-        palette_error += norm(color - new_color);
+        new_colors[i] = color_sums[i] * (1.0/GetCurrentState()->prob_c[i]);
+        palette_error += norm(color - new_colors[i]);
     }
   }
+
+  //over-relax while the steps keep shrinking at the same temperature and 
+  //palette size; anything else restarts from the plain update
+  if(accelerate_palette_ && temperature_ == relaxation_temperature_ &&
+    current_palette_size == relaxation_palette_size_ && 
+    palette_error < relaxation_error_) {
+      relaxation_ = std::min(relaxation_ + kRelaxationStep, kMaxRelaxation);
+  } else {
+    relaxation_ = 1.0f;
+  }
+  relaxation_error_ = palette_error;
+  relaxation_temperature_ = temperature_;
+  relaxation_palette_size_ = current_palette_size;
+
+  //update the palette colors
+  for(int i = 0; i< current_palette_size; ++i) {
+    cv::Vec3d color = GetCurrentState()->palette[i];
+    GetCurrentState()->palette[i] = relaxation_ == 1.0f ? new_colors[i] 
+      : color + (new_colors[i] - color)*relaxation_;
+  }
   return palette_error;
 }
 void Pix::ExpandPalette()
@@ -717,7 +1595,7 @@ void Pix::ExpandPalette()
 
     float subcluster_error = norm(color_1-color_2);
     //mark pair as splitting if distance between exceeds a threshold
-    if(subcluster_error > kSubclusterTolerance) {
+    if(subcluster_error > schedule_->subcluster_tolerance()) {
       splits.push_back(std::pair<float,int>(subcluster_error,index));
     } else { //otherwise make the 2nd SC a slight permutation of the first
       GetCurrentState()->palette[index_2] += 
@@ -767,7 +1645,10 @@ void Pix::SplitColor(int pair_index) {
   GetCurrentState()->sub_superpixel_pairs[pair_index].second = next_index1;
   GetCurrentState()->prob_c[index_1]*=.5f; 
   GetCurrentState()->prob_c.push_back(GetCurrentState()->prob_c[index_1]);
-  prob_co_.push_back(prob_co_[index_1]);
+  //nothing reads the association of the new colors before the next 
+  //palette association, which the sparse one waits for
+  if(sparse_width_ == 0)
+    prob_co_.push_back(prob_co_[index_1]);
 
   //reconstruct second pair
   GetCurrentState()->palette.push_back(subcluster_color_2);
@@ -775,7 +1656,8 @@ void Pix::SplitColor(int pair_index) {
   GetCurrentState()->sub_superpixel_pairs.push_back(new_pair);
   GetCurrentState()->prob_c[index_2]*=.5f;
   GetCurrentState()->prob_c.push_back(GetCurrentState()->prob_c[index_2]);
-  prob_co_.push_back(prob_co_[index_2]);
+  if(sparse_width_ == 0)
+    prob_co_.push_back(prob_co_[index_2]);
 }
 void Pix::CondensePalette() {
   palette_maxed_flag_ = true;
@@ -783,7 +1665,8 @@ void Pix::CondensePalette() {
   std::vector<cv::Vec3f> new_palette;
   std::vector<std::vector<float> > new_prob_co;
   std::vector<float> new_prob_c;
-  cv::Mat nPaletteAssign(GetCurrentState()->palette_assign.size(),CV_32FC3);
+  //merged color of each subsuperpixel
+  std::vector<int> merged(old_palette.size(), 0);
   for(int j = 0; j < GetCurrentState()->sub_superpixel_pairs.size();++j) {
     //average the subsuperpixel colors into a single color
     //weighted by p(c) of each subsuperpixel
@@ -801,17 +1684,18 @@ void Pix::CondensePalette() {
     //update the probability of the single superpixel
     new_prob_c.push_back(GetCurrentState()->prob_c[index_1] + 
       GetCurrentState()->prob_c[index_2]);
-    new_prob_co.push_back(prob_co_[index_1]);
+    if(sparse_width_ == 0)
+      new_prob_co.push_back(prob_co_[index_1]);
+    merged[index_1] = merged[index_2] = j;
+  }
 
-    //for each SP, if it was assigned to either subsuperpixel, assign it to the 
-    //merged superpixel
-    for(int y = 0; y<output_height_; ++y) {
-      for(int x = 0; x<output_width_; ++x) {
-        if (GetCurrentState()->palette_assign.at<int>(y,x) == index_1 
-          || GetCurrentState()->palette_assign.at<int>(y,x) == index_2) {
-            nPaletteAssign.at<int>(y,x) = j;
-        }
-      }
+  //each SP assigned to either subsuperpixel is assigned to the merged 
+  //superpixel, in a single pass
+  cv::Mat nPaletteAssign(GetCurrentState()->palette_assign.size(),CV_32SC1);
+  for(int y = 0; y<output_height_; ++y) {
+    for(int x = 0; x<output_width_; ++x) {
+      nPaletteAssign.at<int>(y,x) = 
+        merged[GetCurrentState()->palette_assign.at<int>(y,x)];
     }
   }
   GetCurrentState()->palette = new_palette;
@@ -819,32 +1703,56 @@ void Pix::CondensePalette() {
   GetCurrentState()->prob_c = new_prob_c;
   prob_oc_ = new_prob_co;
 }
+float Pix::FinishEarlyReserve() {
+  float condense_ms = 0;
+  if(!palette_maxed_flag_) {
+    condense_ms = superpixel_pass_ms_;
+    if(sparse_width_ == 0)
+      condense_ms *= 1 + GetCurrentState()->sub_superpixel_pairs.size();
+  }
+  return kDeadlineReserve*(association_ms_ + condense_ms);
+}
+void Pix::FinishEarly() {
+  //the stages of the abandoned iteration that did complete are kept
+  if(!palette_maxed_flag_)
+    CondensePalette();
+  AssociatePalette();
+  PublishResult();
+}
 std::pair<cv::Vec3f,float> Pix::GetMaxEigen(int palette_index) {
   //for every output pixel
   cv::Mat matrix(cv::Size(3,3),CV_64FC1,cv::Scalar(0.0f));
   float sum = 0;
-  for(int y = 0; y<output_height_; ++y) {
-    for(int x = 0; x<output_width_; ++x) {
-      //get prob(output pixel|palette color)
-      float prob_oc = prob_co_[palette_index][vec2idx(cv::Vec2i(x,y))] 
-      * prob_o_ / GetCurrentState()->prob_c[palette_index];
-      sum += prob_oc;
-      //construct 3x3 matrix and add to sum
-      cv::Vec3d color_error = GetCurrentState()->palette[palette_index] 
-      - GetCurrentState()->superpixel_color.at<cv::Vec3f>(y,x);
-      color_error[0] = abs(color_error[0]);
-      color_error[1] = abs(color_error[1]);
-      color_error[2] = abs(color_error[2]);
-      matrix.at<double>(0,0) += prob_oc*color_error[0]*color_error[0];
-      matrix.at<double>(1,0) += prob_oc*color_error[1]*color_error[0];
-      matrix.at<double>(2,0) += prob_oc*color_error[2]*color_error[0];
-      matrix.at<double>(0,1) += prob_oc*color_error[0]*color_error[1];
-      matrix.at<double>(1,1) += prob_oc*color_error[1]*color_error[1];
-      matrix.at<double>(2,1) += prob_oc*color_error[2]*color_error[1];
-      matrix.at<double>(0,2) += prob_oc*color_error[0]*color_error[2];
-      matrix.at<double>(1,2) += prob_oc*color_error[1]*color_error[2];
-      matrix.at<double>(2,2) += prob_oc*color_error[2]*color_error[2];
+  int samples = palette_samples();
+  for(int i = 0; i<samples; ++i) {
+    //get prob(output pixel|palette color), a bin stands for all of its 
+    //superpixels
+    float prob_oc = AssociationProbability(palette_index, i) 
+    * prob_o_ / GetCurrentState()->prob_c[palette_index];
+    cv::Vec3f color;
+    if(binned_association_) {
+      prob_oc *= bin_counts_[i];
+      color = bin_colors_[i];
+    } else {
+      cv::Vec2i pos = idx2vec(i);
+      color = GetCurrentState()->superpixel_color.at<cv::Vec3f>(pos[1],pos[0]);
     }
+    sum += prob_oc;
+    //construct 3x3 matrix and add to sum
+    cv::Vec3d color_error = GetCurrentState()->palette[palette_index] 
+    - color;
+    color_error[0] = abs(color_error[0]);
+    color_error[1] = abs(color_error[1]);
+    color_error[2] = abs(color_error[2]);
+    matrix.at<double>(0,0) += prob_oc*color_error[0]*color_error[0];
+    matrix.at<double>(1,0) += prob_oc*color_error[1]*color_error[0];
+    matrix.at<double>(2,0) += prob_oc*color_error[2]*color_error[0];
+    matrix.at<double>(0,1) += prob_oc*color_error[0]*color_error[1];
+    matrix.at<double>(1,1) += prob_oc*color_error[1]*color_error[1];
+    matrix.at<double>(2,1) += prob_oc*color_error[2]*color_error[1];
+    matrix.at<double>(0,2) += prob_oc*color_error[0]*color_error[2];
+    matrix.at<double>(1,2) += prob_oc*color_error[1]*color_error[2];
+    matrix.at<double>(2,2) += prob_oc*color_error[2]*color_error[2];
   }
 
   //get critical temperature = largest eigenvalue of convariance matrix
@@ -863,6 +1771,17 @@ std::pair<cv::Vec3f,float> Pix::GetMaxEigen(int palette_index) {
   return std::pair<cv::Vec3f, float>(eVec, eVal);
 }
 
+std::vector<float> Pix::GetCriticalTemperatures() {
+  std::vector<float> temperatures;
+  if(palette_maxed_flag_) return temperatures;
+  for(int j = 0; j < GetCurrentState()->sub_superpixel_pairs.size(); ++j) {
+    //the pair's first subcluster stands for the color, as in ExpandPalette
+    int index = GetCurrentState()->sub_superpixel_pairs[j].first;
+    if(GetCurrentState()->prob_c[index] > 0)
+      temperatures.push_back(sqrt(2*GetMaxEigen(index).second));
+  }
+  return temperatures;
+}
 std::vector<cv::Vec3f> Pix::GetAveragedPalette() {
   std::vector<cv::Vec3f> averaged_palette;
   averaged_palette = GetCurrentState()->palette;
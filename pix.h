@@ -31,20 +31,231 @@ the thesis for details.
 #include <opencv2/opencv.hpp>
 #include "stateList.h"
 #include "utility.h"
+#include "executor.h"
+#include "annealing.h"
+#include "paletteIndex.h"
+#include <algorithm>
 #include <vector>
 #include <list>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
 
 using namespace pix_research;
 
 //algorithm constants
-const float kDT = .7f;
-const float kTF = 1.0f;
 const float kSubclusterPertubation = .8f;
 const float kMaxUndo = 12.0f;
-const float kPaletteErrorTolerance = 1.0f;
-const float kSubclusterTolerance = 1.6f;
 const float kT0SafteyFactor = 1.1f;
+const uint64 kDefaultSeed = 0x9e3779b97f4a7c15ULL;
+//rows per task of the parallel stages over output and input rows. The bands
+//are fixed, so results are the same on every executor.
+const int kOutputBandRows = 8;
+const int kInputBandRows = 32;
+//bands run by Pix::Step() between checks of its time budget, and per 
+//thread of the executor by Pix::RunUntil() between checks of its deadline
+//and cancel token
+const int kStepBands = 4;
+//weight of the latest iteration in the running cost estimates of 
+//Pix::RunUntil()
+const float kCostSmoothing = .3f;
+//time Pix::RunUntil() keeps for finishing early, in multiples of the 
+//estimated palette association time
+const float kDeadlineReserve = 2.0f;
+//superpixel colors sampled by the k-means++ palette seeding, and the edge
+//length of the L*a*b* bins of the histogram seeding
+const int kSeedSamples = 4096;
+const float kSeedBinSize = 8.0f;
+//over-relaxation of the accelerated palette refinement: the factor grows
+//by kRelaxationStep per shrinking step up to kMaxRelaxation
+const float kRelaxationStep = .2f;
+const float kMaxRelaxation = 1.8f;
+//edge length of the L*a*b* bins of the binned palette EM, and bins per 
+//task of its parallel stages
+const float kPaletteBinSize = 1.0f;
+const int kPaletteBinBand = 1024;
+//probability below which the sparse association drops a color
+const float kSparseEpsilon = 1e-4f;
+//palette size from which the sparse association looks up the colors of a
+//superpixel in a PaletteIndex instead of scanning the palette
+const int kPaletteIndexColors = 32;
+
+//Reported by Pix::Run() after every iteration
+struct PixProgress {
+  //number of completed iterations of the instance
+  int iteration;
+  float temperature;
+  //the total change of the palette colors in the iteration's refinement
+  float palette_error;
+  //number of distinct colors, a color split into subclusters counts once
+  int palette_size;
+  //fraction of the output pixels whose color changed in the iteration
+  float assignment_churn;
+  //mean distance the superpixels moved in the iteration, in input pixels
+  float superpixel_movement;
+};
+
+typedef std::function<void(const PixProgress&)> PixProgressCallback;
+
+//Cancels a Pix::Run() from another thread, or from a signal handler.
+class PixCancelToken {
+ public:
+  PixCancelToken() : cancelled_(false) {}
+  inline void Cancel() {cancelled_ = true;}
+  inline bool cancelled() const {return cancelled_;}
+ private:
+  std::atomic<bool> cancelled_;
+};
+
+//Result of Pix::Run()
+enum PixRunStatus {
+  kRunConverged,
+  //max_iter iterations were run without converging
+  kRunMaxIterations,
+  kRunCancelled,
+  //the deadline of Pix::RunUntil() was reached, the result is the best 
+  //one so far
+  kRunDeadline
+};
+
+//Result of Pix::Step()
+enum PixStepStatus {
+  //the budget ran out within an iteration, the next call resumes there
+  kStepInProgress,
+  //an iteration was completed
+  kStepIterated,
+  //the algorithm has converged, no work is left
+  kStepConverged
+};
+
+//Ways for a run to converge at the final temperature besides a palette
+//error below the schedule's tolerance, for runs that would otherwise 
+//oscillate there until they run out of iterations. Negative values 
+//disable a criterion; all are disabled by default.
+struct ConvergenceCriteria {
+  //converge once, for patience iterations in a row, at most max_churn of
+  //the output pixels changed color and the superpixels moved by at most 
+  //max_movement input pixels on average. If only one of the two is 
+  //enabled, it decides alone.
+  float max_churn;
+  float max_movement;
+  int patience;
+  //converge once the palette error varied by less than window_tolerance 
+  //over the last error_window iterations
+  int error_window;
+  float window_tolerance;
+
+  ConvergenceCriteria() : max_churn(-1), max_movement(-1), patience(1),
+    error_window(-1), window_tolerance(-1) {}
+};
+
+//How Pix::Initialize() sets up the palette
+enum PaletteSeeding {
+  //a single color, the mean of the input, that is split as the temperature
+  //falls until the palette is full. The full annealing path and the best 
+  //quality; the default.
+  kSeedSplit,
+  //a full palette picked by k-means++ from a sample of the superpixel 
+  //colors
+  kSeedKMeansPlusPlus,
+  //a full palette of the heaviest bins of a coarse L*a*b* histogram of 
+  //the superpixel colors
+  kSeedHistogram
+};
+
+//Why a Pix instance converged, see Pix::convergence()
+enum PixConvergence {
+  kNotConverged,
+  //the palette error fell below the schedule's tolerance
+  kConvergedPaletteError,
+  //assignments and superpixels stopped changing 
+  //(ConvergenceCriteria::max_churn and max_movement)
+  kConvergedStalled,
+  //the palette error stopped changing (ConvergenceCriteria::error_window)
+  kConvergedErrorWindow
+};
+
+//returns a short description of a convergence reason, e.g. for logs
+const char * PixConvergenceName(PixConvergence convergence);
+
+//Describes the output artifacts to render in a single call to
+//Pix::RenderOutputs(). Only artifacts with a non NULL destination are
+//computed. Destinations are (re)allocated as 8U, rgb images only if their
+//size or type does not already match.
+struct PixOutputs {
+  //the output image, output width x output height
+  cv::Mat * output;
+  //the output image upscaled by upscale_factor using nearest neighbour
+  cv::Mat * upscaled;
+  int upscale_factor;
+  //the superpixel color values, output width x output height
+  cv::Mat * superpixel;
+  //the input image with the superpixel segmentation visualized
+  cv::Mat * region;
+
+  PixOutputs() : output(NULL), upscaled(NULL), upscale_factor(1),
+    superpixel(NULL), region(NULL) {}
+};
+
+//The result of a run, detached from the algorithm state. Holds everything
+//needed to render the output image again (see Pix::RenderResult()), so it
+//can be stored, e.g. in a ResultCache, and reused without running Pix.
+struct PixResult {
+  //the palette index of each output pixel, CV_32SC1, output size
+  cv::Mat palette_assign;
+  //the averaged L*a*b* palette indexed by palette_assign, not saturated
+  std::vector<cv::Vec3f> palette;
+  float saturation;
+  int iterations;
+
+  PixResult() : saturation(1.0f), iterations(0) {}
+};
+
+typedef std::shared_ptr<const PixResult> PixResultPtr;
+
+//The input of the algorithm: the image converted to L*a*b* and the per 
+//pixel weights. A PixInput never changes after it is created, so any number
+//of Pix instances, also on different threads, can share one without copying
+//the image.
+class PixInput {
+ public:
+  //Converts an 32F, 3 channel rgb image with values in [0,1] (the format Pix
+  //expects) to L*a*b*. weights is a CV_32FC1 image of the same size, or 
+  //empty for uniform weights.
+  static std::shared_ptr<const PixInput> FromRgb(const cv::Mat& img_rgb, 
+    const cv::Mat& weights);
+
+  //Copies an image that is already in L*a*b*. weights as in FromRgb().
+  static std::shared_ptr<const PixInput> FromLab(const cv::Mat& img_lab, 
+    const cv::Mat& weights);
+
+  //returns an input with the same L*a*b* image, which is shared, and the 
+  //given weights
+  std::shared_ptr<const PixInput> WithWeights(const cv::Mat& weights) const;
+
+  inline const cv::Mat& lab() const {return lab_;}
+  inline const cv::Mat& weights() const {return weights_;}
+  inline int width() const {return lab_.cols;}
+  inline int height() const {return lab_.rows;}
+
+ private:
+  PixInput() {}
+
+  //sets weights_ to a copy of weights, or uniform weights if it is empty
+  void SetWeights(const cv::Mat& weights);
+
+  cv::Mat lab_, weights_;
+};
 
+typedef std::shared_ptr<const PixInput> PixInputPtr;
+
+//Thread safety: all mutable state, including the random number generator,
+//belongs to an instance, so different instances can be used concurrently 
+//from different threads, also when they share a PixInput. A single instance
+//must not be used from several threads at once, except for 
+//GetPublishedResult(), which any thread may call at any time.
 class Pix {
 
  public:
@@ -54,6 +265,11 @@ class Pix {
   //should be an 8U, 3 channel rgb image.
   Pix(const cv::Mat& img_input, int w, int h, int p);
 
+  //Constructs a new Pix object attached to a shared input. Only the 
+  //algorithm state is per instance, so concurrent instances on the same 
+  //input cost no more than their state.
+  Pix(const PixInputPtr& input, int w, int h, int p);
+
   //Constructs a new Pix Object from a file a .pix file from a previous session
   //Do not need to call initialize if using this constructor.
   Pix(std::string filename);
@@ -68,9 +284,44 @@ class Pix {
   void SaveToFile(std::string filename);
 
   //Performs a single iteration of the algorithm. Does nothing if
-  //converged_flag_ is set to true.
+  //converged_flag_ is set to true. Completes an iteration partially run by 
+  //Step().
   void Iterate();
 
+  //Advances the algorithm for about budget_ms milliseconds and returns 
+  //whether that completed an iteration. Work is done in slices of a few
+  //bands of the current stage (superpixel mapping and means, palette 
+  //association and refinement) and the next call resumes with the next 
+  //slice, so a call takes at most budget_ms plus one slice. A budget of 0
+  //runs a single slice. Stops early at the end of an iteration. Until an
+  //iteration is complete the state is partially updated, e.g. the output 
+  //image may mix the assignments of two iterations. Running a stage outside
+  //Step() (AssociatePalette(), Undo(), Redo()) restarts the iteration.
+  PixStepStatus Step(double budget_ms);
+
+  //Iterates until convergence or until max_iter iterations were completed,
+  //calling progress (if set) on this thread after every iteration. cancel 
+  //(if not NULL) is checked between slices of a few bands per thread of a
+  //stage (see Step()), so a cancellation takes effect within milliseconds.
+  //Without one, whole stages run at once. The 
+  //iteration running at that point stays partially run: further calls to 
+  //Run(), Step() or Iterate() complete it, and GetPublishedResult() holds 
+  //the last completed one.
+  PixRunStatus Run(int max_iter, const PixProgressCallback& progress, 
+    const PixCancelToken* cancel);
+
+  //Runs like Run(), but returns a usable result by deadline. The cost of 
+  //an iteration and of its palette association are estimated by 
+  //Initialize() and tracked as the run goes: an iteration is only started if it is expected to complete in 
+  //time, and one that runs late is abandoned. The run then finishes early:
+  //subclusters are condensed into single colors (as when the palette is 
+  //maxed out), the superpixels are associated with the resulting palette 
+  //and the result is published, and kRunDeadline is returned. The 
+  //instance can keep iterating afterwards, with the condensed palette.
+  PixRunStatus RunUntil(std::chrono::steady_clock::time_point deadline, 
+    int max_iter, const PixProgressCallback& progress, 
+    const PixCancelToken* cancel);
+
   //associates superpixels with colors in the palette
   void AssociatePalette();
 
@@ -83,8 +334,116 @@ class Pix {
   //returns the input image with the superpixel segmentation visualized
   void GetRegionImage(cv::Mat& img);
 
-  //Sets the input weights. Only call before initialization.
-  inline void set_input_weights(cv::Mat& w){w.copyTo(input_weights_);}
+  //renders every requested artifact in a single pass over the output rows,
+  //run in bands on the executor. See PixOutputs.
+  void RenderOutputs(const PixOutputs& outputs);
+
+  //returns the current result, see PixResult
+  void GetResult(PixResult& result);
+
+  //returns the result of the last completed iteration, or of the 
+  //initialization before the first one. Safe to call from any number of
+  //threads while another one iterates: each completed iteration publishes
+  //a new result through an atomic pointer swap and a published result is
+  //never modified, so readers neither block nor are blocked. Edits between
+  //iterations are published with the next iteration. NULL before 
+  //Initialize().
+  PixResultPtr GetPublishedResult() const;
+
+  //returns the 8U rgb color of each palette entry of a result, saturated,
+  //indexed like result.palette
+  static std::vector<cv::Vec3b> GetResultPalette(const PixResult& result);
+
+  //returns the weighted mean L*a*b* distance (CIE76 delta E) between each
+  //input pixel and the palette color of the superpixel it belongs to. The
+  //output saturation is not applied.
+  float GetColorError();
+
+  //renders the output and upscaled output of a stored result. The other
+  //artifacts of PixOutputs need the algorithm state and are ignored.
+  static void RenderResult(const PixResult& result, const PixOutputs& outputs);
+
+  //Sets the input weights. Only call before initialization. A shared input
+  //is not modified: this instance switches to an input of its own that 
+  //shares the L*a*b* image.
+  inline void set_input_weights(const cv::Mat& w){
+    input_ = input_->WithWeights(w);
+    input_weights_ = input_->weights();
+  }
+
+  //returns the input, e.g. to attach further instances to it
+  inline PixInputPtr input() const {return input_;}
+
+  //Sets the executor that runs the parallel stages of this instance. NULL 
+  //selects SerialExecutor::Shared(), the default. Executors can be shared 
+  //between instances.
+  inline void set_executor(const ExecutorPtr& executor){
+    executor_ = executor ? executor : SerialExecutor::Shared();
+  }
+
+  //Sets the annealing schedule of this instance. NULL selects a 
+  //GeometricSchedule, the default. A schedule set after Initialize() 
+  //continues from the current temperature. Schedules keep state about the
+  //run and cannot be shared between instances.
+  void set_schedule(const AnnealingSchedulePtr& schedule);
+  inline AnnealingSchedulePtr schedule() const {return schedule_;}
+
+  //Selects how Initialize() sets up the palette. The seeded palettes skip
+  //the phase transitions of the splitting: annealing starts with the full
+  //palette, at the highest critical temperature of the seeded colors, so 
+  //it refines the seeds without merging them. Faster, especially for 
+  //large palettes, at some cost in quality. Set before Initialize().
+  inline void set_palette_seeding(PaletteSeeding seeding){seeding_ = seeding;}
+  inline PaletteSeeding palette_seeding() const {return seeding_;}
+
+  //Enables the accelerated palette refinement. The plain refinement moves
+  //every color to the weighted mean of its superpixels, which approaches 
+  //the fixed point of a temperature slowly. The accelerated one moves 
+  //further in the same direction, by a factor that grows while the steps
+  //shrink, and falls back to the plain update as soon as a step grows or 
+  //the temperature or palette size changes. The palette error it reports
+  //is that of the plain update, so equilibrium is judged as before. Off 
+  //by default.
+  inline void set_palette_acceleration(bool enabled){
+    accelerate_palette_ = enabled;
+    relaxation_ = 1.0f;
+    relaxation_error_ = relaxation_temperature_ = 0;
+    relaxation_palette_size_ = 0;
+  }
+  inline bool palette_acceleration() const {return accelerate_palette_;}
+
+  //Enables the binned palette EM. The palette association, refinement and
+  //color covariances then run over the superpixel colors quantized into 
+  //L*a*b* bins of kPaletteBinSize, each weighted by its superpixels, 
+  //instead of over every superpixel, so their cost grows with the number 
+  //of distinct colors rather than with the output size. Superpixels with 
+  //pixel constraints keep a bin of their own, and every superpixel takes 
+  //the color of its bin. Pays off for large outputs, at the cost of a 
+  //result that differs slightly from the exact one. Off by default, takes
+  //effect at the next palette association.
+  inline void set_binned_palette(bool enabled){binned_palette_ = enabled;}
+  inline bool binned_palette() const {return binned_palette_;}
+
+  //Enables the sparse association. Instead of the probability of every 
+  //palette color for every superpixel, only the up to max_colors most 
+  //probable colors above epsilon are kept, renormalized, which bounds the
+  //memory and the work of the palette refinement and covariances by 
+  //max_colors instead of the palette size. How many colors a superpixel 
+  //keeps follows the temperature: while it is high, many colors are above
+  //epsilon, close to the final one mostly one or two. 0 keeps all colors,
+  //the default; other values are raised to 2, so superpixels can tell the
+  //two subclusters of a color apart. Takes effect at the next palette 
+  //association.
+  inline void set_sparse_association(int max_colors, 
+    float epsilon = kSparseEpsilon) {
+    sparse_max_colors_ = max_colors > 0 ? std::max(2, max_colors) : 0;
+    sparse_epsilon_ = epsilon;
+  }
+  inline int sparse_association_colors() const {return sparse_max_colors_;}
+
+  //Seeds the random number generator of this instance. Instances start with
+  //kDefaultSeed, so runs are reproducible unless seeded otherwise.
+  inline void set_seed(uint64 seed){rng_ = cv::RNG(seed);}
 
   //Sets the laplacian factor used to smooth the superpixel positions.
   inline void set_laplacian_factor(float f){smooth_pos_factor_ = f;}
@@ -146,9 +505,9 @@ class Pix {
 
   //returns an 8U, rgb image representing the superpixel color values
   inline void GetSuperpixelImage(cv::Mat& img) {
-    cv::Mat rgb;
-    cv::cvtColor(GetCurrentState()->superpixel_color, rgb, CV_Lab2RGB);
-    rgb.convertTo(img, CV_8UC3, 255.0);
+    PixOutputs outputs;
+    outputs.superpixel = &img;
+    RenderOutputs(outputs);
   }
 
   //returns a vector the same size as the palette, indicating whether
@@ -166,6 +525,20 @@ class Pix {
   //returns true if the algorithm has converged
   inline bool hasConverged(){return converged_flag_;}
 
+  //returns why the algorithm converged, kNotConverged if it has not
+  inline PixConvergence convergence() const {
+    return converged_flag_ ? convergence_ : kNotConverged;
+  }
+
+  //Sets the criteria that end a run at the final temperature early. See 
+  //ConvergenceCriteria.
+  inline void set_convergence_criteria(const ConvergenceCriteria& criteria){
+    convergence_criteria_ = criteria;
+  }
+  inline const ConvergenceCriteria& convergence_criteria() const {
+    return convergence_criteria_;
+  }
+
   //returns the current iteration number
   inline int get_iteration(){return GetCurrentState()->iteration;}
 
@@ -214,20 +587,141 @@ class Pix {
   }
 
  private: 
+  //Runs body(band, begin, end) on the executor for every band of 
+  //band_rows rows in [0, rows). Returns the number of bands.
+  int ForEachBand(int rows, int band_rows, 
+    const std::function<void(int,int,int)>& body);
+
+  //Runs body like ForEachBand(), but only for the bands [first, last)
+  void ForBandRange(int rows, int band_rows, int first, int last, 
+    const std::function<void(int,int,int)>& body);
+
+  //Stages of an iteration, in order. See Step().
+  enum StepPhase {
+    kPhaseMapping, kPhaseMeans, kPhaseAssociation, kPhaseRefinement
+  };
+
+  //Runs the next slice of the current iteration: up to max_bands bands 
+  //of the current stage, all remaining ones if max_bands is 0, or the 
+  //serial work finishing it. Returns true if the iteration was completed.
+  bool StepSlice(int max_bands);
+
+  //Runs the next max_bands bands (all if 0) of a stage over rows, starting
+  //at step_band_. Returns false if all bands had already been run.
+  bool StepBands(int rows, int band_rows, int max_bands, 
+    const std::function<void(int,int,int)>& body);
+
+  //Restarts Step() at the beginning of an iteration
+  inline void ResetStep() {step_phase_ = kPhaseMapping; step_band_ = 0;}
+
+  //Applies the palette error of the finished refinement: once the schedule
+  //finds the palette at equilibrium, lowers the temperature or detects 
+  //convergence and expands the palette. Counts the iteration.
+  void FinishIteration(float palette_error);
+
+  //Checks the ConvergenceCriteria after an iteration at the final 
+  //temperature that did not reach equilibrium. Returns the criterion that 
+  //is met, or kNotConverged.
+  PixConvergence CheckStall(float palette_error);
+
+  //Renders the requested artifacts for output rows [begin, end).
+  //palette_rgb holds the 8U rgb value of each (averaged, saturated) palette
+  //entry. Rows of different calls do not overlap, so calls may run in
+  //parallel.
+  void RenderOutputRows(const PixOutputs& outputs, 
+    const std::vector<cv::Vec3b>& palette_rgb, int begin, int end);
+
+  //Converts a L*a*b* palette to 8U rgb, scaling a* and b* by saturation
+  static std::vector<cv::Vec3b> PaletteToRgb(
+    const std::vector<cv::Vec3f>& palette, float saturation);
+
+  //Renders the output and upscaled output for output rows [begin, end)
+  //from the palette index of each output pixel.
+  static void RenderPaletteRows(const cv::Mat& palette_assign, 
+    const std::vector<cv::Vec3b>& palette_rgb, const PixOutputs& outputs, 
+    int begin, int end);
+
   //Updates the mapping of input pixels to superpixels
   void UpdateSuperpixelMapping();
 
+  //The parts of UpdateSuperpixelMapping(): setup, the parallel work for 
+  //input rows [begin, end), and building region_list_
+  void BeginSuperpixelMapping();
+  void MapSuperpixelRows(int begin, int end);
+  void FinishSuperpixelMapping();
+
   //Updates superpixel color and spatial values
   void UpdateSuperpixelMeans();
 
+  //The parts of UpdateSuperpixelMeans(): setup, summing the pixels of the
+  //superpixels in output rows [begin, end), and averaging and smoothing
+  void BeginSuperpixelMeans();
+  void SumSuperpixelRows(int begin, int end);
+  void FinishSuperpixelMeans();
+
+  //The parts of AssociatePalette(): setup, associating the superpixels of
+  //output rows [begin, end) of a band, and summing up prob(c). While the 
+  //palette EM is binned, the rows are bins and FinishPaletteAssociation() 
+  //assigns every superpixel the color of its bin.
+  void BeginPaletteAssociation();
+  void AssociatePaletteRows(int band, int begin, int end);
+  void FinishPaletteAssociation();
+
+  //Associates a color of the given weight with the palette, or only with 
+  //the colors in constraints if there are any: sets column sample of 
+  //prob_co_ and adds to new_prob_c. Returns the closest color.
+  int AssociateColor(const cv::Vec3f& color, 
+    const std::list<int>& constraints, double weight, int sample, 
+    std::vector<float>& new_prob_c);
+
+  //Lists the colors whose probability for a superpixel of the given color
+  //can reach the sparse epsilon, looked up in palette_index_. Returns 
+  //false if the palette is not indexed or no bound applies; then every 
+  //color is a candidate.
+  bool ListLikelyColors(const cv::Vec3f& color, std::list<int>& candidates);
+
+  //Returns prob(color|sample) of the last palette association
+  float AssociationProbability(int color, int sample) const;
+
+  //Adds color times weight times prob(c|sample) to sums[c] for every 
+  //palette color c the sample is associated with
+  void SumAssociatedColors(int sample, const cv::Vec3d& color, float weight, 
+    std::vector<cv::Vec3d>& sums) const;
+
+  //Quantizes the superpixel colors into the bins of the binned palette EM
+  //if it is enabled, otherwise clears the bins. Called when the palette 
+  //stages start over the current superpixel colors.
+  void BinSuperpixelColors();
+
+  //The rows the palette stages are banded over and the rows per band: 
+  //output rows, or bins while the palette EM is binned
+  inline int palette_rows() const {
+    return binned_association_ ? (int)bin_colors_.size() : output_height_;
+  }
+  inline int palette_band_rows() const {
+    return binned_association_ ? kPaletteBinBand : kOutputBandRows;
+  }
+
+  //the number of columns of prob_co_: superpixels, or bins while the 
+  //palette EM is binned
+  inline int palette_samples() const {
+    return binned_association_ ? (int)bin_colors_.size() : 
+      output_width_*output_height_;
+  }
+
   //Smooths the superpixel positions using laplacian smoothing.
   void SmoothSuperpixelPositions();
 
   //Smooths the superpixel colors using a bilateral filter. 
   void SmoothSuperpixelColors();
 
-  //Refines the palette based on superpixel association to colors
-  float RefinePalette();
+  //Refine the palette based on superpixel association to colors: setup,
+  //the weighted color sums of output rows (or bins) [begin, end) of a 
+  //band, and updating the palette. FinishPaletteRefinement() returns the change of 
+  //the palette.
+  void BeginPaletteRefinement();
+  void SumPaletteRows(int band, int begin, int end);
+  float FinishPaletteRefinement();
 
   //Checks to see if any color in the palette needs to be split. Calls 
   //SplitColor() on any such colors. If the maximum palette size is reached, 
@@ -243,18 +737,44 @@ class Pix {
   //superpixel (no subsuperpixels)
   void CondensePalette();
 
+  //Time RunUntil() keeps for FinishEarly() in milliseconds
+  float FinishEarlyReserve();
+
+  //Abandons the current iteration, condenses the palette and associates 
+  //the superpixels with it. See RunUntil().
+  void FinishEarly();
+
   // returns the largest Eigenvector and Eigenvalue of the color in the palette
   //at the given index.
   std::pair<cv::Vec3f, float> GetMaxEigen(int palette_index);
 
+  //Returns the seed colors of the kSeedKMeansPlusPlus and kSeedHistogram 
+  //palettes, at most max_palette_size_ and fewer if the superpixels have 
+  //fewer distinct colors.
+  std::vector<cv::Vec3f> SeedKMeansPlusPlus();
+  std::vector<cv::Vec3f> SeedHistogram();
+
+  //Sets up a full palette of seeds and its starting temperature
+  void InitializeSeededPalette(const std::vector<cv::Vec3f>& seeds);
+
+  //returns the critical temperature of every subcluster pair, empty once 
+  //the palette is maxed out. See AnnealingState.
+  std::vector<float> GetCriticalTemperatures();
+
   //returns the palette with subsuperpixels set to their weighted average
   std::vector<cv::Vec3f> GetAveragedPalette();
 
   //returns the current algorithm state
   inline pixState * GetCurrentState(){return state_list_->getCur();}
 
+  //publishes the current result for GetPublishedResult()
+  void PublishResult();
+
   int output_width_, output_height_, input_width_, input_height_, max_palette_size_;
   int range_;
+  //input_img_ and input_weights_ refer to the data of input_ and are only
+  //ever read
+  PixInputPtr input_;
   cv::Mat input_img_, output_img_;
   cv::Mat input_weights_, superpixel_weights_;
   cv::Mat region_map_;
@@ -265,8 +785,70 @@ class Pix {
   float slic_factor_; 
   float smooth_pos_factor_; 
   float temperature_; 
+  //palette error of the last completed iteration
+  float palette_error_;
+  //running estimates of the time of an iteration and of its palette 
+  //association in milliseconds, seeded by Initialize()
+  float iteration_ms_, association_ms_;
+  //time of one pass over the superpixels, measured by Initialize(). 
+  //CondensePalette() costs about one pass, plus one per subcluster pair 
+  //in the dense association.
+  float superpixel_pass_ms_;
+  ConvergenceCriteria convergence_criteria_;
+  PixConvergence convergence_;
+  //the accelerated refinement: its switch, current over-relaxation factor, 
+  //and the plain step size, temperature and palette size of the last 
+  //refinement
+  PaletteSeeding seeding_;
+  bool accelerate_palette_;
+  float relaxation_, relaxation_error_, relaxation_temperature_;
+  int relaxation_palette_size_;
+  //the binned palette EM: its switch and whether the last association was
+  //binned. Per bin its (weighted mean) color, weight, number of 
+  //superpixels, the superpixel of a constrained bin or -1, and the closest
+  //color found by the last association. superpixel_bins_ holds the bin of
+  //every superpixel.
+  bool binned_palette_, binned_association_;
+  std::vector<cv::Vec3f> bin_colors_;
+  std::vector<float> bin_weights_;
+  std::vector<int> bin_counts_, bin_constrained_, bin_assign_;
+  std::vector<int> superpixel_bins_;
+  //the sparse association: its limits, and the colors and probabilities
+  //of each sample in sparse_width_ slots, of which sparse_counts_ are 
+  //used. sparse_width_ is 0 while prob_co_ holds a dense association.
+  int sparse_max_colors_;
+  float sparse_epsilon_;
+  int sparse_width_;
+  std::vector<int> sparse_colors_, sparse_counts_;
+  std::vector<float> sparse_probs_;
+  //the palette as indexed for the sparse association, whether the current
+  //association uses it, and the largest prob(c) of the association
+  PaletteIndex palette_index_;
+  bool palette_indexed_;
+  float max_prob_c_;
+  //changes measured by the last palette association and superpixel means
+  float assignment_churn_, superpixel_movement_;
+  //iterations in a row that met the stall criteria, and the palette errors
+  //of the last iterations, both at the final temperature
+  int stall_iterations_;
+  std::deque<float> error_window_;
   float sigma_color_, sigma_position_; 
   bool converged_flag_, palette_maxed_flag_; 
   stateList * state_list_; 
+  cv::RNG rng_;
+  ExecutorPtr executor_;
+  AnnealingSchedulePtr schedule_;
+  //only accessed with std::atomic_load and std::atomic_store
+  PixResultPtr published_result_;
+  //where Step() resumes: the stage and its next band
+  StepPhase step_phase_;
+  int step_band_;
+  //intermediate results of the stages, kept between Step() calls
+  std::vector<cv::Vec3f> mapping_palette_;
+  cv::Mat mapping_distance_;
+  cv::Mat means_color_sums_, means_pos_sums_, means_counts_, means_old_pos_;
+  std::vector<std::vector<float> > band_prob_c_;
+  std::vector<int> band_churn_;
+  std::vector<std::vector<cv::Vec3d> > band_color_sums_;
 
 };
@@ -0,0 +1,78 @@
+#include "pixWorker.h"
+
+PixWorker::PixWorker(Pix* pix, double slice_ms)
+  : pix_(pix), slice_ms_(slice_ms), mid_iteration_(false),
+    iterating_(false), stop_(false) {
+  thread_ = std::thread(&PixWorker::Run, this);
+}
+PixWorker::~PixWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+  delete pix_;
+}
+void PixWorker::Post(const Edit& edit) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    edits_.push_back(edit);
+  }
+  wake_.notify_one();
+}
+void PixWorker::SetIterating(bool iterating) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    iterating_ = iterating;
+  }
+  wake_.notify_one();
+}
+PixSnapshotPtr PixWorker::snapshot() const {
+  return std::atomic_load(&snapshot_);
+}
+void PixWorker::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true) {
+    //pix_ is only ever used on this thread, also in the predicate
+    wake_.wait(lock, [this]() {
+      return stop_ || !edits_.empty() || mid_iteration_ ||
+        (iterating_ && !pix_->hasConverged());
+    });
+    if(stop_)
+      return;
+    std::deque<Edit> edits;
+    if(!mid_iteration_)
+      edits.swap(edits_);
+    bool iterating = iterating_;
+    lock.unlock();
+
+    for(size_t i = 0; i < edits.size(); ++i) {
+      edits[i](*pix_);
+    }
+    if(!edits.empty())
+      Publish();
+
+    //an iteration that is already running is completed even if iterating
+    //was stopped, so the queued edits see a consistent state
+    if(mid_iteration_ || (iterating && !pix_->hasConverged())) {
+      mid_iteration_ = pix_->Step(slice_ms_) == kStepInProgress;
+      if(!mid_iteration_)
+        Publish();
+    }
+    lock.lock();
+  }
+}
+void PixWorker::Publish() {
+  std::shared_ptr<PixSnapshot> snapshot(new PixSnapshot());
+  PixOutputs outputs;
+  outputs.output = &snapshot->output;
+  outputs.superpixel = &snapshot->superpixel;
+  pix_->RenderOutputs(outputs);
+  snapshot->palette = pix_->GetPalette();
+  snapshot->locked_colors = pix_->get_locked_colors();
+  snapshot->pixel_constraints = pix_->get_pixel_constraints();
+  snapshot->iteration = pix_->get_iteration();
+  snapshot->converged = pix_->hasConverged();
+  std::atomic_store(&snapshot_, PixSnapshotPtr(snapshot));
+}
@@ -0,0 +1,88 @@
+/*
+Description: Runs a Pix instance on a worker thread. Only the worker touches
+the instance: other threads queue edits to it, which are applied between
+iterations, and read the state of the last completed iteration from an
+immutable snapshot that is swapped in atomically, so they never wait for an
+iteration to finish.
+*/
+
+#pragma once
+
+#include "pix.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//The state of a Pix instance after an iteration or after a batch of edits.
+//Snapshots are not modified once they are published.
+struct PixSnapshot {
+  //the output image and the superpixel mean image, 8U rgb
+  cv::Mat output, superpixel;
+  //as returned by Pix::GetPalette(), get_locked_colors() and
+  //get_pixel_constraints()
+  std::vector<cv::Vec3f> palette;
+  std::vector<bool> locked_colors;
+  std::vector<std::list<int> > pixel_constraints;
+  int iteration;
+  bool converged;
+};
+
+typedef std::shared_ptr<const PixSnapshot> PixSnapshotPtr;
+
+class PixWorker {
+ public:
+  //A change to the instance, run on the worker thread
+  typedef std::function<void(Pix&)> Edit;
+
+  //Starts the worker thread, which takes ownership of pix. The worker
+  //iterates in Pix::Step() slices of slice_ms milliseconds, so shutting it
+  //down never waits for a whole iteration. pix does not need to be
+  //initialized yet: Post() Initialize() as the first edit to keep it off
+  //the calling thread. There is no snapshot until the first edit or
+  //iteration.
+  PixWorker(Pix* pix, double slice_ms);
+
+  //Stops the worker thread and deletes the instance. A partially run
+  //iteration is abandoned.
+  ~PixWorker();
+
+  //Queues an edit. Queued edits run in order once the current iteration is
+  //complete, followed by a new snapshot.
+  void Post(const Edit& edit);
+
+  //Starts or stops iterating. The worker idles once the algorithm has
+  //converged. Only edits that call Pix::SetColor(), SetColorLock(),
+  //SetPixelConstraints() or SetColorFromSP() clear the convergence and
+  //resume it; other edits, such as SetSaturation(), leave it idle.
+  void SetIterating(bool iterating);
+
+  //returns the latest snapshot, or NULL if there is none yet
+  PixSnapshotPtr snapshot() const;
+
+ private:
+  PixWorker(const PixWorker&);
+  PixWorker& operator=(const PixWorker&);
+
+  void Run();
+
+  //renders and publishes a snapshot of the current state
+  void Publish();
+
+  Pix* pix_;
+  double slice_ms_;
+  //set while an iteration is partially run; edits wait for its end
+  bool mid_iteration_;
+  PixSnapshotPtr snapshot_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<Edit> edits_;
+  bool iterating_, stop_;
+  std::thread thread_;
+};
@@ -30,8 +30,8 @@ Author: Timothy Gerstner, timgerst@cs.rutgers.edu
 #include "CinderOpenCV.h"
 
 PixUI::~PixUI() {
-  if(pix_)
-    delete pix_;
+  if(worker_)
+    delete worker_;
 }
 void PixUI::prepareSettings(Settings * settings) {
   settings->setTitle("Pix");
@@ -56,8 +56,7 @@ void PixUI::setup() {
   brush_size_ = 1;
   superpixels_are_visible_ = false;
   output_is_hidden_ = false;
-  pix_ = NULL;
-  output_img_is_outdated_ = false;
+  worker_ = NULL;
   weight_img_is_outdated_ = false;
 
   InitializeBar();
@@ -99,9 +98,9 @@ void PixUI::update() {
   //only send saturation update when value has changed
   if(state_ != NODATA && state_!= WEIGHTING && 
     previous_saturation_ != saturation_) {
-      pix_->SetSaturation(saturation_);
+      float saturation = saturation_;
+      worker_->Post([saturation](Pix& pix) {pix.SetSaturation(saturation);});
       previous_saturation_ = saturation_;
-      output_img_is_outdated_ = true;
   }
 
   //maintain aspect ratio of output
@@ -125,8 +124,6 @@ void PixUI::update() {
     PaintWeight();
     break;
   case ITERATING:
-    pix_->Iterate();
-    output_img_is_outdated_ = true;
     break;
   case EDIT:
     PaintPixels();
@@ -134,25 +131,21 @@ void PixUI::update() {
   }
 
 
-  if(state_ == ITERATING && pix_->hasConverged()) {
-    SetState(EDIT);
-    brush_size_ = std::max(brush_size_,1.0f);
-    Reassociate();
-  }
-
-  //update the output image as needed
-  if(output_img_is_outdated_) {
-    cv::Mat o;
-    pix_->GetOutputImage(o);
-    output_img_ = fromOcv(o);
+  //take over the images of a new snapshot
+  PixSnapshotPtr snapshot = worker_ ? worker_->snapshot() : PixSnapshotPtr();
+  if(snapshot && snapshot != snapshot_) {
+    snapshot_ = snapshot;
+    output_img_ = fromOcv(snapshot_->output);
     output_img_.setMagFilter(GL_NEAREST);
-
-    cv::Mat r;
-    pix_->GetSuperpixelImage(r);
-    average_img_ = fromOcv(r);
+    average_img_ = fromOcv(snapshot_->superpixel);
     average_img_.setMagFilter(GL_NEAREST);
+  }
 
-    output_img_is_outdated_ = false;
+  if(state_ == ITERATING && snapshot_ && snapshot_->converged) {
+    worker_->SetIterating(false);
+    SetState(EDIT);
+    brush_size_ = std::max(brush_size_,1.0f);
+    Reassociate();
   }
 
   //update the weight image as needed
@@ -174,11 +167,14 @@ void PixUI::draw(){
   case WEIGHTING:
     DrawWeightingMode();
     break;
+  //there is nothing to show until the worker published a snapshot
   case ITERATING:
-    DrawIteratingMode();
+    if(snapshot_)
+      DrawIteratingMode();
     break;
   case EDIT:
-    DrawEditMode();
+    if(snapshot_)
+      DrawEditMode();
     break;
   }
 
@@ -200,11 +196,11 @@ void PixUI::keyUp(KeyEvent event) {
     output_is_hidden_ = false;
     break;
   case KeyEvent::KEY_y:
-    pix_->Redo();
+    worker_->Post([](Pix& pix) {pix.Redo();});
     Reassociate();
     break;
   case KeyEvent::KEY_z:
-    pix_->Undo();
+    worker_->Post([](Pix& pix) {pix.Undo();});
     Reassociate();
     break;
   }
@@ -220,7 +216,7 @@ void PixUI::keyDown(KeyEvent event) {
   }
 }
 void PixUI::mouseDown(MouseEvent e) {
-  if(state_ == EDIT) {
+  if(state_ == EDIT && snapshot_) {
     int color_index = GetPaletteClick(e.getPos());
     cv::Vec2i pixel = GetImgClick(e.getPos(), output_width_, output_height_);
     if(color_index >= 0) {
@@ -236,28 +232,33 @@ void PixUI::mouseDown(MouseEvent e) {
         }
         if(selected_list.size() == 1) {
           bar_.setOptions("Edit Color", "visible = true");
-          cv::Vec3f pixel = pix_->GetPalette()[selected_list.front()];
+          cv::Vec3f pixel = snapshot_->palette[selected_list.front()];
           color_picker_ = ci::Color(pixel[0],pixel[1],pixel[2]);
         } else {
           bar_.setOptions("Edit Color", "visible = false");
         }
       } else if(e.isRight()) {
-        pix_->SaveState();
-        pix_->SetColorLock(color_index, !pix_->GetColorLock(color_index));
+        worker_->Post([color_index](Pix& pix) {
+          pix.SaveState();
+          pix.SetColorLock(color_index, !pix.GetColorLock(color_index));
+        });
       }
-    } else if(pixel[0] >= 0 && pixel[0] < pix_->get_output_width() 
-      && pixel[1] >= 0 && pixel[1] < pix_->get_output_height()) {
+    } else if(pixel[0] >= 0 && pixel[0] < output_width_ 
+      && pixel[1] >= 0 && pixel[1] < output_height_) {
         if(e.isAltDown()) {
           if(selected_list.size() == 1) {
-            pix_->SaveState();
-            pix_->SetColorFromSP(selected_list.front(), pixel);
-            pix_->SetColorLock(selected_list.front(), true);
+            int index = selected_list.front();
+            worker_->Post([index, pixel](Pix& pix) {
+              pix.SaveState();
+              pix.SetColorFromSP(index, pixel);
+              pix.SetColorLock(index, true);
+            });
             Reassociate();
           }
         } else {
           if(e.isLeft() || e.isRight()) {
             MOUSECLICK t;
-            pix_->SaveState();
+            worker_->Post([](Pix& pix) {pix.SaveState();});
             if(e.isLeft()) t = LEFT;
             else t = RIGHT;
             paint_queue_.push(std::pair<cv::Vec2i, MOUSECLICK>(pixel,t));
@@ -319,19 +320,23 @@ void PixUI::mouseDrag(MouseEvent e) {
 
 }
 void PixUI::Process(){
-  if(pix_ == NULL) {
+  if(worker_ == NULL) {
     //toOcv won't convert to CV32FC3
     cv::Mat in8U = toOcv(input_img_);
     cv::Mat in32;
     in8U.convertTo(in32, CV_32FC3, 1.0/255.0);
 
-    pix_ = new Pix(in32, output_width_, output_height_, max_palette_size_);
-    pix_->SetBilateralParams(sigma_color_, sigma_position_);
-    pix_->set_laplacian_factor(smooth_factor_);
-    pix_->setSlicFact(slic_factor_);
-    pix_->set_input_weights(input_weights);
-    pix_->SetSaturation(saturation_);
-    pix_->Initialize();
+    Pix * pix = new Pix(in32, output_width_, output_height_, max_palette_size_);
+    pix->SetBilateralParams(sigma_color_, sigma_position_);
+    pix->set_laplacian_factor(smooth_factor_);
+    pix->setSlicFact(slic_factor_);
+    pix->set_input_weights(input_weights);
+    pix->SetSaturation(saturation_);
+    previous_saturation_ = saturation_;
+    //initialize on the worker, the interface keeps drawing meanwhile
+    worker_ = new PixWorker(pix, kIterationBudgetMs);
+    worker_->Post([](Pix& pix) {pix.Initialize();});
+    snapshot_.reset();
 
     paint_queue_ = std::queue<std::pair<cv::Vec2i, MOUSECLICK>>();
     selected_colors = std::vector<bool>(max_palette_size_, false);
@@ -339,14 +344,14 @@ void PixUI::Process(){
     brush_size_ = .5;
 
   } else {
-    pix_->SaveState();
+    worker_->Post([](Pix& pix) {pix.SaveState();});
   }
 
+  worker_->SetIterating(true);
   SetState(ITERATING);
 }
 void PixUI::Reassociate() {
-  output_img_is_outdated_ = true;
-  pix_->AssociatePalette();
+  worker_->Post([](Pix& pix) {pix.AssociatePalette();});
 }
 void PixUI::InitializeBar() {
   bar_ = interface("Menu", ci::Vec2i(220,400));
@@ -559,9 +564,9 @@ void PixUI::DrawIteratingMode()
   std::stringstream stream;
   stream <<"Processing: ";
   stream <<"Itr: ";
-  stream <<pix_->get_iteration();
+  stream <<snapshot_->iteration;
   stream <<" Colors: ";
-  stream <<pix_->GetPalette().size();
+  stream <<snapshot_->palette.size();
   set_message(stream.str());
 }
 void PixUI::DrawEditMode()
@@ -597,10 +602,10 @@ void PixUI::DrawEditMode()
     if(fixed_are_visible_){
       glLineWidth(2.0f);
       gl::color(1.0f,1.0f,0.0f,1.0f);
-      std::vector<std::list<int>> lp = pix_->get_pixel_constraints();
+      const std::vector<std::list<int>>& lp = snapshot_->pixel_constraints;
       for(int i = 0; i< output_img_.getWidth(); ++i){
         for(int j = 0; j < output_img_.getHeight(); ++j){
-          int num_constraints = lp[pix_->vec2idx(cv::Vec2i(i,j))].size();
+          int num_constraints = lp[i + j*output_img_.getWidth()].size();
 
           if(num_constraints > 0){
             gl::drawStrokedRect(Rectf(i, j, i+1, j+1));
@@ -634,8 +639,8 @@ void PixUI::DrawEditMode()
 }
 void PixUI::DrawPalette()
 {
-  std::vector<cv::Vec3f> palette = pix_->GetPalette();
-  std::vector<bool> locks = pix_->get_locked_colors();
+  const std::vector<cv::Vec3f>& palette = snapshot_->palette;
+  const std::vector<bool>& locks = snapshot_->locked_colors;
 
   for(int i = 0; i< palette.size(); ++i) {
     Rectf color_area = GetPalettePos(i);
@@ -743,10 +748,10 @@ Rectf PixUI::GetPreviewPos() {
 Rectf PixUI::GetPalettePos(int idx) {
   float width = kPaletteW*getWindowWidth();
   float height = kPaletteH*getWindowHeight()- kLabelH;	
-  float length = sqrt(width*height/pix_->get_max_palette_size());
+  float length = sqrt(width*height/max_palette_size_);
   int num_wide = (int)ceil(width/length);
   int num_high = (int)floor(height/length);
-  if(num_wide*num_high < pix_->get_max_palette_size()) {
+  if(num_wide*num_high < max_palette_size_) {
     num_high = (int)ceil(height/length);
   }
 
@@ -774,7 +779,7 @@ cv::Vec2i PixUI::GetImgClick(ci::Vec2i click, int w, int h) {
   return pixel;
 }
 int PixUI::GetPaletteClick(ci::Vec2i click) {
-  for(int i = 0; i<pix_->get_max_palette_size(); ++i) {
+  for(int i = 0; i<max_palette_size_; ++i) {
     Rectf color_area = GetPalettePos(i);
     if(color_area.contains(click))
       return i;
@@ -783,6 +788,7 @@ int PixUI::GetPaletteClick(ci::Vec2i click) {
 }
 void PixUI::PaintPixels() {
   if(paint_queue_.empty()) return;
+  std::vector<std::pair<cv::Vec2i, std::list<int> > > constraints;
   while(!paint_queue_.empty()) {
     std::pair<cv::Vec2i, MOUSECLICK> next = paint_queue_.front();
     paint_queue_.pop();
@@ -793,12 +799,16 @@ void PixUI::PaintPixels() {
 
     std::list<cv::Vec2i>  area = GetPixelBrush(next.first);
     for(std::list<cv::Vec2i>::iterator n = area.begin(); n != area.end(); ++n) {
-      pix_->SetPixelConstraints(*n, con);
+      constraints.push_back(std::make_pair(*n, con));
     }
   }
 
-  pix_->AssociatePalette();
-  output_img_is_outdated_ = true;
+  worker_->Post([constraints](Pix& pix) {
+    for(int i = 0; i<constraints.size(); ++i) {
+      pix.SetPixelConstraints(constraints[i].first, constraints[i].second);
+    }
+    pix.AssociatePalette();
+  });
 
 }
 void PixUI::PaintWeight() {
@@ -846,9 +856,8 @@ std::list<cv::Vec2i> PixUI::GetPixelBrush(cv::Vec2i center) {
 void PixUI::SetColor() {
   if(selected_list.size() != 1) return;
   int index = selected_list.front();
-  pix_->SetColor(index, cv::Vec3f(color_picker_.r, 
-    color_picker_.g, 
-    color_picker_.b)); 
+  cv::Vec3f color(color_picker_.r, color_picker_.g, color_picker_.b);
+  worker_->Post([index, color](Pix& pix) {pix.SetColor(index, color);});
   Reassociate();
 }
 void PixUI::UpdateWeightImg(){
@@ -886,19 +895,22 @@ void PixUI::LoadProj() {
   if(filename.empty()) return;
   try {
     Pix * next = new Pix(filename);
-    if(pix_)
-      delete pix_;
-    pix_ = next;
+    if(worker_)
+      delete worker_;
     cv::Mat in;
-    pix_->GetInputImage(in);
+    next->GetInputImage(in);
     input_img_ = fromOcv(in);
-    selected_colors = std::vector<bool>(pix_->get_max_palette_size(), false);
+    selected_colors = std::vector<bool>(next->get_max_palette_size(), false);
     selected_list.clear();
-    output_width_ = pix_->get_output_width();
-    output_height_ = pix_->get_output_height();
-    max_palette_size_ = pix_->get_max_palette_size();
+    output_width_ = next->get_output_width();
+    output_height_ = next->get_output_height();
+    max_palette_size_ = next->get_max_palette_size();
+    worker_ = new PixWorker(next, kIterationBudgetMs);
+    //every edit is followed by a snapshot; this one only publishes the 
+    //loaded state
+    worker_->Post([](Pix&) {});
+    snapshot_.reset();
     SetState(EDIT);
-    output_img_is_outdated_ = true;
   } catch(...) {
     return;
   }	
@@ -913,8 +925,9 @@ void PixUI::Reset() {
   }
 
   if(state_ != WEIGHTING) {
-    if(pix_) delete pix_;
-    pix_ = NULL;
+    if(worker_) delete worker_;
+    worker_ = NULL;
+    snapshot_.reset();
     SetState(WEIGHTING);
     output_width_ = output_height_*input_img_.getAspectRatio()+.5f;
     previous_height_ = output_height_;
@@ -927,20 +940,23 @@ void PixUI::Reset() {
 
 }
 void PixUI::SaveProj() {
-  if(pix_ == NULL) return;
+  if(worker_ == NULL) return;
 
   std::vector<std::string> exts;
   exts.push_back("pix");
   std::string filename = SaveFileDialog(exts);
   if(filename.empty()) return;
-  try {
-    pix_->SaveToFile(filename);		
-  } catch(...) {
-    return;
-  }	
+  //saved on the worker, after the edits made so far
+  worker_->Post([filename](Pix& pix) {
+    try {
+      pix.SaveToFile(filename);		
+    } catch(...) {
+      return;
+    }	
+  });
 }
 void PixUI::SaveImg() {
-  if(pix_ == NULL) return;
+  if(snapshot_ == NULL) return;
   std::vector<std::string> exts;
   exts.push_back("png");
   std::string filename = SaveFileDialog(exts);
@@ -33,6 +33,7 @@ project webpage for a description of how to use the UI.
 #include "cinder\gl\Texture.h"
 #include "cinder\params\Params.h"
 #include "pix.h"
+#include "pixWorker.h"
 #include "interface.h"
 #include "cinder\Text.h"
 #include <queue>
@@ -55,7 +56,8 @@ class PixUI : public AppBasic
   //sets up the interface into the NODATA state
   void setup();
 
-  //updates the interface. iterates the algorithm.
+  //updates the interface with the latest snapshot of the algorithm, which
+  //iterates on a worker thread
   void update();
 
   //draws the current view based on state
@@ -85,8 +87,7 @@ class PixUI : public AppBasic
   //the Pix object.
   void Process();
 
-  //calls Pix object functions to reassociate superpixels to colors in the
-  //palette
+  //queues the reassociation of superpixels to colors in the palette
   void Reassociate();
 
   //initializes the anttweakbar
@@ -146,7 +147,7 @@ class PixUI : public AppBasic
   //any color. 
   int GetPaletteClick(ci::Vec2i click);
 
-  //applies pixel constraints based on the current paint queue
+  //queues pixel constraints based on the current paint queue
   void PaintPixels();
 
   //draws weights to the weight map based on the current paint
@@ -189,7 +190,10 @@ class PixUI : public AppBasic
   //end of the file path.
   std::string SaveFileDialog(std::vector<std::string> exts);
 
-  Pix * pix_;
+  //runs the algorithm. Every change to it is posted to the worker, and 
+  //the interface only reads snapshot_, the latest snapshot it has shown.
+  PixWorker * worker_;
+  PixSnapshotPtr snapshot_;
   gl::Texture input_img_, output_img_, average_img_, weight_img_;
   gl::Texture lock_img_, select_img_, palette_label_, preview_label_;
   int output_width_, output_height_, max_palette_size_;
@@ -198,7 +202,6 @@ class PixUI : public AppBasic
   STATE state_;
   interface bar_;
   bool fixed_are_visible_;
-  bool output_img_is_outdated_;
   bool weight_img_is_outdated_;
   bool output_is_hidden_;
   bool superpixels_are_visible_;
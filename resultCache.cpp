@@ -0,0 +1,178 @@
+#include "resultCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+//header of an entry file, followed by the palette (3 floats per color) and
+//the palette index of every output pixel (int32, row major)
+const char kEntryMagic[4] = {'P','I','X','R'};
+const int kEntryVersion = 1;
+struct EntryHeader {
+  char magic[4];
+  int32_t version;
+  int32_t width, height, palette_size, iterations;
+  float saturation;
+};
+
+ResultKey::ResultKey() {
+  hash_[0] = kFnvOffsetBasis;
+  //a second basis so both hashes disagree from the first byte
+  hash_[1] = kFnvOffsetBasis ^ 0x9e3779b97f4a7c15ULL;
+}
+void ResultKey::Add(const void * data, size_t size) {
+  const unsigned char * bytes = static_cast<const unsigned char *>(data);
+  uint64_t h0 = hash_[0], h1 = hash_[1];
+  for(size_t i = 0; i<size; ++i) {
+    h0 = (h0 ^ bytes[i]) * kFnvPrime;
+    h1 = (h1 ^ (unsigned char)(bytes[i] + 0x5c)) * kFnvPrime;
+  }
+  hash_[0] = h0;
+  hash_[1] = h1;
+}
+void ResultKey::Add(const std::string& text) {
+  uint64_t size = text.size();
+  Add(&size, sizeof(size));
+  Add(text.data(), text.size());
+}
+void ResultKey::Add(const cv::Mat& img) {
+  int32_t header[3] = {img.cols, img.rows, img.type()};
+  Add(header, sizeof(header));
+  size_t row_bytes = img.cols*img.elemSize();
+  for(int y = 0; y<img.rows; ++y) {
+    Add(img.ptr(y), row_bytes);
+  }
+}
+std::string ResultKey::str() const {
+  char text[33];
+  snprintf(text, sizeof(text), "%016llx%016llx", 
+    (unsigned long long)hash_[0], (unsigned long long)hash_[1]);
+  return text;
+}
+
+ResultCache::ResultCache(const std::string& directory, size_t max_bytes) 
+  : directory_(directory), max_bytes_(max_bytes), temporary_count_(0) {
+  mkdir(directory_.c_str(), 0777);
+}
+
+bool ResultCache::Lookup(const std::string& key, PixResult& result) {
+  std::string path = EntryPath(key);
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if(!file)
+    return false;
+
+  EntryHeader header;
+  bool valid = file.read((char *)&header, sizeof(header)) &&
+    std::equal(kEntryMagic, kEntryMagic + 4, header.magic) &&
+    header.version == kEntryVersion && header.width > 0 && 
+    header.height > 0 && header.palette_size > 0;
+  if(valid) {
+    result.palette.resize(header.palette_size);
+    result.palette_assign.create(header.height, header.width, CV_32SC1);
+    valid = !file.read((char *)&result.palette[0], 
+      header.palette_size*sizeof(cv::Vec3f)).fail();
+    for(int y = 0; valid && y<header.height; ++y) {
+      valid = !file.read((char *)result.palette_assign.ptr(y), 
+        header.width*sizeof(int32_t)).fail();
+    }
+  }
+  if(valid) {
+    //a truncated or foreign file must not index outside the palette
+    double min_index, max_index;
+    cv::minMaxLoc(result.palette_assign, &min_index, &max_index);
+    valid = min_index >= 0 && max_index < header.palette_size;
+  }
+  if(!valid) {
+    unlink(path.c_str());
+    return false;
+  }
+  result.saturation = header.saturation;
+  result.iterations = header.iterations;
+
+  //the modification time orders entries for eviction
+  utime(path.c_str(), NULL);
+  return true;
+}
+
+bool ResultCache::Store(const std::string& key, const PixResult& result) {
+  if(result.palette.empty() || result.palette_assign.type() != CV_32SC1)
+    return false;
+  std::ostringstream temporary;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    temporary << directory_ << "/." << key << "." << getpid() << "." 
+      << temporary_count_++;
+  }
+
+  EntryHeader header;
+  std::copy(kEntryMagic, kEntryMagic + 4, header.magic);
+  header.version = kEntryVersion;
+  header.width = result.palette_assign.cols;
+  header.height = result.palette_assign.rows;
+  header.palette_size = result.palette.size();
+  header.iterations = result.iterations;
+  header.saturation = result.saturation;
+  {
+    std::ofstream file(temporary.str().c_str(), std::ios::binary);
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)&result.palette[0], 
+      result.palette.size()*sizeof(cv::Vec3f));
+    for(int y = 0; y<header.height; ++y) {
+      file.write((const char *)result.palette_assign.ptr(y), 
+        header.width*sizeof(int32_t));
+    }
+    if(!file.flush()) {
+      file.close();
+      unlink(temporary.str().c_str());
+      return false;
+    }
+  }
+  if(rename(temporary.str().c_str(), EntryPath(key).c_str()) != 0) {
+    unlink(temporary.str().c_str());
+    return false;
+  }
+  Evict();
+  return true;
+}
+
+void ResultCache::Evict() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DIR * dir = opendir(directory_.c_str());
+  if(!dir)
+    return;
+  //(modification time, path) and size of every entry
+  std::vector<std::pair<std::pair<time_t, std::string>, size_t> > entries;
+  size_t total = 0;
+  while(struct dirent * entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if(name[0] == '.' || name.size() < 5 || 
+      name.compare(name.size() - 5, 5, ".pixr") != 0)
+      continue;
+    std::string path = directory_ + "/" + name;
+    struct stat info;
+    if(stat(path.c_str(), &info) != 0)
+      continue;
+    entries.push_back(std::make_pair(std::make_pair(info.st_mtime, path), 
+      (size_t)info.st_size));
+    total += info.st_size;
+  }
+  closedir(dir);
+  if(total <= max_bytes_)
+    return;
+
+  std::sort(entries.begin(), entries.end());
+  for(size_t i = 0; i<entries.size() && total > max_bytes_; ++i) {
+    if(unlink(entries[i].first.second.c_str()) == 0)
+      total -= entries[i].second;
+  }
+}
@@ -0,0 +1,70 @@
+/* 
+Description: An on-disk cache of Pix results. Entries are addressed by a key
+computed from the input image and every parameter that affects the result,
+so a repeated run with the same input and parameters can skip the algorithm
+and render the stored result instead. The total size of the cache is bounded;
+the least recently used entries are removed first.
+*/
+
+#pragma once
+
+#include "pix.h"
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+//Builds the key of a cache entry by hashing everything that affects a
+//result. Uses two independently seeded 64 bit FNV-1a hashes, which is
+//plenty to tell inputs apart but not meant to resist deliberate collisions.
+class ResultKey {
+ public:
+  ResultKey();
+
+  void Add(const void * data, size_t size);
+  void Add(const std::string& text);
+  //hashes the size, type and pixel data of an image
+  void Add(const cv::Mat& img);
+
+  //returns the key as 32 hex digits
+  std::string str() const;
+
+ private:
+  uint64_t hash_[2];
+};
+
+//A directory of cached results, one file per key. Lookup() and Store() can
+//be called from several threads, and several processes can share a
+//directory: entries are written under a temporary name and renamed into
+//place, so readers only ever see complete entries.
+class ResultCache {
+ public:
+  //Uses (and creates) directory. max_bytes bounds the total size of the
+  //entries.
+  ResultCache(const std::string& directory, size_t max_bytes);
+
+  //Reads the entry for key into result and marks it as recently used.
+  //Returns false if there is no (valid) entry.
+  bool Lookup(const std::string& key, PixResult& result);
+
+  //Writes result as the entry for key, then removes the least recently used
+  //entries while the cache is larger than its bound. Returns false if the
+  //entry could not be written.
+  bool Store(const std::string& key, const PixResult& result);
+
+  inline const std::string& directory() const {return directory_;}
+
+ private:
+  //removes the least recently used entries until the cache fits max_bytes_
+  void Evict();
+
+  inline std::string EntryPath(const std::string& key) const {
+    return directory_ + "/" + key + ".pixr";
+  }
+
+  std::string directory_;
+  size_t max_bytes_;
+  //serializes eviction and numbers temporary files
+  std::mutex mutex_;
+  unsigned temporary_count_;
+};
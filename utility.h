@@ -38,20 +38,21 @@ namespace pix_research
     return exp((x-mean)*(x-mean)/(-2.0f*sigma*sigma))/sqrt(6.28319*sigma*sigma);
   }
 
-  //returns a random vector of unit length
-  inline cv::Vec3f randVec()
+  //returns a random vector of unit length. Takes the generator explicitly
+  //(each Pix has its own) since the global rand() is shared by all threads.
+  inline cv::Vec3f randVec(cv::RNG& rng)
   {
-    cv::Vec3f p((float) (rand() % 100), 
-      (float) (rand() % 100),
-      (float) (rand() % 100));
+    cv::Vec3f p((float) rng.uniform(0, 100), 
+      (float) rng.uniform(0, 100),
+      (float) rng.uniform(0, 100));
     p *= 1.0f/(float)norm(p);
     return p;
   }
 
-  //returns a random float in the range [0,1]
-  inline float randFloat()
+  //returns a random float in the range [0,1)
+  inline float randFloat(cv::RNG& rng)
   {
-    return (float)rand()/(float)RAND_MAX;
+    return rng.uniform(0.0f, 1.0f);
   }
 
   //returns true if string "fullstring" ends with any of the strings in the 